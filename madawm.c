@@ -1,34 +1,407 @@
 // miniwm.c - Fixed Minimal Window Manager
 // 2 workspaces: WS0 for terminals, WS1 for browsers
-// Build: gcc -o miniwm miniwm.c -lX11
+// Build: gcc -o miniwm miniwm.c -pthread -lX11 -lX11-xcb -lxcb
 // Run: startx /path/to/miniwm -- :1
+// Control: miniwm msg "ws 2" "spawn xterm" (or one command per line on stdin)
+
+#define _GNU_SOURCE  // POSIX_SPAWN_SETSID
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/Xatom.h>
 #include <X11/keysym.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <spawn.h>
+#include <fcntl.h>
 
 #define WORKSPACES 2
 #define BORDER_WIDTH 2
 #define BORDER_FOCUS 0x4A90D9    // Blue
 #define BORDER_UNFOCUS 0x333333  // Dark gray
+#define CLIENT_TABLE_MIN 64      // Initial hash table capacity (power of two)
+#define CLASS_TABLE_SIZE 64      // Must exceed 2x the configured classes
+#define PROTOCOLS_MAX 32         // WM_PROTOCOLS atoms read per window
+
+// Coalescing window for relayouts caused by client churn; 0 = relayout as
+// soon as the event queue is drained
+#ifndef RELAYOUT_DELAY_MS
+#define RELAYOUT_DELAY_MS 0
+#endif
+
+// Opt-in: freeze processes whose windows all sit on hidden workspaces once
+// they have been hidden for FREEZE_GRACE_MS (cgroup v2 freezer when the
+// process has its own cgroup, SIGSTOP/SIGCONT otherwise)
+#ifndef FREEZE_BACKGROUND
+#define FREEZE_BACKGROUND 0
+#endif
+#ifndef FREEZE_GRACE_MS
+#define FREEZE_GRACE_MS 5000
+#endif
+
+// Opt-in: renice processes by focus; the focused app gets CPU first.
+// Unprivileged users cannot lower a nice value again without RLIMIT_NICE,
+// so nice levels are only used when RLIMIT_NICE allows NICE_FOCUSED.
+#ifndef PRIORITY_BOOST
+#define PRIORITY_BOOST 0
+#endif
+#define NICE_FOCUSED 0
+#define NICE_UNFOCUSED 5
+#define NICE_BACKGROUND 10
+// Also write cpu.weight of the app's own cgroup v2
+#ifndef PRIORITY_CGROUP
+#define PRIORITY_CGROUP 0
+#endif
+#define WEIGHT_FOCUSED 400
+#define WEIGHT_UNFOCUSED 100
+#define WEIGHT_BACKGROUND 25
+// Also set a uclamp minimum on the focused app's main thread
+#ifndef PRIORITY_UCLAMP
+#define PRIORITY_UCLAMP 0
+#endif
+#define UCLAMP_MIN_FOCUSED 512
+#define PRIO_QUEUE 64
+
+// Hidden, already running terminals kept ready for Super+Enter
+#ifndef TERMINAL_POOL
+#define TERMINAL_POOL 0
+#endif
+#define LAUNCH_TIMEOUT_MS 60000  // Forget launches that never mapped a window
+#define PLACEHOLDER_TIMEOUT_MS 5000  // Give up a reserved tile after this
+#define EARLY_EXIT_MS 5000        // Failing this soon after spawn is a startup crash
+#define CHILD_HISTORY 32          // Exited children kept for dump_stats
+#define LOOP_BUDGET_US 4000       // Stop draining X events to flush and relayout
+#define IPC_BUF 4096              // Longest IPC command line
+#define SUB_BUF 16384             // Unsent events kept per subscriber
+#define SNAPSHOT_CLIENTS 256      // Clients listed in the shared snapshot
+#define SNAPSHOT_MAGIC 0x6d616461 // "mada"
+#define SNAPSHOT_VERSION 1
+#define SPAWN_ARGS_MAX 32        // Words in a command run without /bin/sh
+
+// Log-linear latency histograms: 2^HIST_SUB_BITS buckets per power of two
+// (about 6% resolution), values up to 2^HIST_MAX_BITS in whatever unit is
+// recorded (microseconds for launches, nanoseconds for handlers)
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+// Event classes an IPC client can subscribe to
+#define EVENT_WORKSPACE (1 << 0)
+#define EVENT_FOCUS     (1 << 1)
+#define EVENT_CLIENT    (1 << 2)
+#define EVENT_LAYOUT    (1 << 3)
+
+// WM_PROTOCOLS support, cached per client
+#define PROTO_TAKE_FOCUS    (1 << 0)
+#define PROTO_DELETE_WINDOW (1 << 1)
+
+// _NET_WM_STATE bits we publish, cached per client
+#define NET_STATE_HIDDEN  (1 << 0)
+#define NET_STATE_FOCUSED (1 << 1)
+
+// EWMH atoms, interned in one round trip
+enum {
+    NetSupported, NetSupportingWMCheck, NetWMName, NetNumberOfDesktops,
+    NetCurrentDesktop, NetWMDesktop, NetWMState, NetWMStateHidden,
+    NetWMStateFocused, NetWMPid, NetStartupId, NetUTF8String, NetLast
+};
 
 typedef struct Client {
     Window w;
     int workspace;
-    struct Client *next;
+    int x, y, width, height;     // Last geometry we applied, width 0 = unknown
+    int mapped;                  // Last map state we applied
+    unsigned int protocols;      // PROTO_* flags
+    int park;                    // Hidden by moving off-screen, not by unmapping
+    int parked;                  // Currently off-screen; x/y still hold the tile
+    unsigned int net_state;      // NET_STATE_* bits last written to _NET_WM_STATE
+    pid_t pid;                   // From _NET_WM_PID, 0 if unknown or untrusted
+    int pooled;                  // Warm pool terminal: managed, on no workspace
+    int placeholder;             // Tile reserved for a launch, no window (w == None)
+    struct LaunchStats *launch;  // Where launch_us is recorded once shown
+    uint64_t launch_us;          // Spawn or pool take time, until first shown
+    struct Client *next, *prev;  // Links within the workspace list
 } Client;
 
+// Clients of one workspace in tiling order (newest first). Clients are
+// reparented into the workspace's container window, so showing or hiding
+// a whole workspace is a single map or unmap.
+typedef struct {
+    Window container;
+    Client *head, *tail;
+    int count;
+    int dirty;  // Layout is out of date, redone when next shown
+} Workspace;
+
+// How a background process is currently stopped
+enum { FROZEN_NONE, FROZEN_CGROUP, FROZEN_SIGNAL };
+
+// Scheduling class of a process, indexes the NICE_/WEIGHT_ tables
+enum { PRIO_FOCUSED, PRIO_UNFOCUSED, PRIO_BACKGROUND, PRIO_LAST };
+
+// What an fd in the main loop's epoll set is
+enum {
+    WatchX, WatchLayout, WatchFreeze, WatchPlaceholder, WatchSignal,
+    WatchIpc, WatchIpcClient, WatchLast
+};
+
+// A process owning managed windows, found through _NET_WM_PID
+typedef struct Proc {
+    pid_t pid;
+    int nclients[WORKSPACES];
+    int prio;                      // PRIO_* last queued, -1 before the first
+    int frozen;                    // FROZEN_*
+    pid_t signal_target;           // pid or -pgid that got SIGSTOP
+    unsigned long long cpu_ticks;  // utime + stime when last sampled
+    uint64_t sampled_us;           // When it went to the background
+    uint64_t frozen_us;
+    double cpu_rate;               // CPU seconds per second before freezing
+    struct Proc *next;
+} Proc;
+
+typedef struct {
+    uint64_t count, sum, max;
+    uint32_t buckets[HIST_BUCKETS];
+} Histogram;
+
+// Cost of one kind of handler dispatched from run()
+typedef struct {
+    Histogram latency_ns;
+    unsigned long requests;     // X requests issued
+    unsigned long round_trips;  // Reply waits
+} HandlerStats;
+
+// Handler slots past the X event types, for work run() does itself and
+// for event types we have no handler for (extensions, bogus synthetic ones)
+enum {
+    HANDLER_PENDING = LASTEvent, HANDLER_LAYOUT, HANDLER_IPC, HANDLER_OTHER,
+    HANDLER_LAST
+};
+
+// Taken before a handler runs
+typedef struct {
+    uint64_t ns;
+    unsigned long requests, round_trips;
+} HandlerMark;
+
+// Spawn-to-map latency of one command line
+typedef struct LaunchStats {
+    char cmd[64];
+    Histogram latency;
+    unsigned long exits, early_exits;  // early_exits: failed within EARLY_EXIT_MS
+    uint64_t cpu_us;                   // User + system time of exited children
+    struct LaunchStats *next;
+} LaunchStats;
+
+// A process we started and have not seen a window from yet. Its window is
+// recognised by _NET_WM_PID or by the DESKTOP_STARTUP_ID we handed it.
+typedef struct Launch {
+    pid_t pid;
+    char startup_id[64];
+    int pooled;  // Its window goes to the terminal pool
+    struct Client *placeholder;  // Tile reserved for its window, if any
+    LaunchStats *stats;
+    uint64_t spawned_us;
+    struct Launch *next;
+} Launch;
+
+// A process we spawned, until wait4() reaps it and then in the history ring
+typedef struct Child {
+    pid_t pid;
+    char cmd[64];
+    LaunchStats *stats;  // NULL for pool terminals
+    uint64_t start_us, end_us;
+    int status;          // From wait4()
+    struct rusage ru;
+    struct Child *next;
+} Child;
+
+// A connection on the IPC socket with its unfinished command line. A
+// subscriber also has a bounded buffer of events not yet sent.
+typedef struct IpcClient {
+    int fd;
+    char in[IPC_BUF];
+    size_t len;
+    unsigned events;        // EVENT_* subscribed to
+    char *out;              // SUB_BUF bytes once subscribed
+    size_t out_len;
+    unsigned long dropped;  // Events lost since the buffer was last full
+    int eof;                // Peer is done writing, still receiving events
+    uint32_t watching;      // Current epoll interest
+    struct IpcClient *next;
+} IpcClient;
+
+// Shared-memory copy of the WM state, rewritten only after it changed.
+// Readers map it read-only and use the seqlock: load seq, copy, load seq
+// again; the copy is good if both loads match and are even.
+typedef struct {
+    uint32_t window;
+    int32_t pid;
+    int32_t x, y, width, height;  // width 0 until first laid out
+    uint8_t workspace;            // 0-based
+    uint8_t mapped, focused, parked;
+} SnapshotClient;
+
+typedef struct {
+    uint32_t magic, version, size;  // Fixed; size is sizeof(Snapshot)
+    _Atomic uint32_t seq;           // Odd while an update is in progress
+    uint64_t updated_us;            // CLOCK_MONOTONIC of the last update
+    int32_t screen_w, screen_h;
+    uint32_t current_ws, workspaces;
+    uint32_t focused;               // Window, 0 if none
+    uint32_t nclients;              // Entries in clients[]
+    uint32_t truncated;             // Clients that did not fit
+    uint32_t ws_clients[WORKSPACES];
+    SnapshotClient clients[SNAPSHOT_CLIENTS];
+} Snapshot;
+
+// A priority change handed to the worker thread
+typedef struct {
+    pid_t pid;
+    int prio;
+} PrioJob;
+
+// A MapRequest whose property replies are still in flight
+typedef struct {
+    Window w;
+    int gone;  // Destroyed before the replies were read
+    xcb_get_property_cookie_t wm_class, wm_protocols, wm_pid, wm_machine, startup_id;
+} PendingMap;
+
+// Requests issued by the layout code, dumped on exit
+typedef struct {
+    unsigned long arranges;
+    unsigned long moveresizes, maps, parks;
+    unsigned long borders;                // Border repaints, two per focus change
+    unsigned long net_states;             // _NET_WM_STATE writes
+    unsigned long last_arrange_requests;  // All X requests of the last arrange()
+    unsigned long switches;
+    unsigned long last_switch_requests;   // All X requests of the last change_ws()
+    unsigned long map_batches;            // Reply waits for pending maps
+    unsigned long batched_maps;           // MapRequests resolved by those waits
+    unsigned long freezes, thaws;
+    uint64_t frozen_ms;                   // Total time processes spent frozen
+    uint64_t cpu_saved_ms;                // Estimated from pre-freeze CPU rate
+    unsigned long prio_queued;
+    unsigned long prio_dropped;           // Queue full
+    atomic_ulong prio_adjustments;        // Syscalls/writes done by the worker
+    atomic_ulong prio_failures;
+    unsigned long pool_hits, pool_misses;
+    unsigned long child_exits, child_failures, early_exits;
+    unsigned long placeholders, placeholder_hits, placeholders_expired;
+    unsigned long configures_denied;      // Tiled clients told to stay put
+    unsigned long spawns;
+    uint64_t spawn_us;                    // Time the WM spent launching
+    unsigned long wakeups;                // Returns from epoll_wait()
+    unsigned long x_events;
+    unsigned long budget_overruns;        // Drains cut short by LOOP_BUDGET_US
+    uint64_t idle_us;                     // Time blocked in epoll_wait()
+    Histogram events_per_wakeup;
+    unsigned long ipc_connections, ipc_commands, ipc_errors;
+    unsigned long ipc_dropped;            // Clients that did not read replies
+    unsigned long events_published;
+    unsigned long events_dropped;         // Subscriber buffers full
+    unsigned long snapshots;              // Shared snapshot rewrites
+    unsigned long round_trips;            // Waits for an X reply
+} Stats;
+
 Display *dpy;
+xcb_connection_t *xcb;  // Same connection, for pipelined property reads
 Window root;
 int screen_w, screen_h;
-Client *clients = NULL;
+Workspace workspaces[WORKSPACES];
+Client *focused = NULL;  // Client holding input focus, kept without asking the server
+PendingMap *pending = NULL;
+int npending = 0, pending_cap = 0;
+Proc *procs = NULL;
+int freeze_timer = -1;    // timerfd for FREEZE_GRACE_MS
+char own_cgroup[512];     // Never freeze or reweight a cgroup that contains the WM
+char hostname[256];       // Compared with WM_CLIENT_MACHINE
+
+// Priority worker: the main loop only queues, syscalls happen off-thread
+PrioJob prio_queue[PRIO_QUEUE];
+int prio_len = 0, prio_stop = 0;
+pthread_mutex_t prio_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prio_cond = PTHREAD_COND_INITIALIZER;
+pthread_t prio_thread;
+int nice_reversible = 0;  // We may raise a process back to NICE_FOCUSED
+
+Client *pool = NULL;  // Warm terminals, linked through next/prev
+int pool_count = 0;
+int pool_launching = 0;
+Launch *launches = NULL;
+LaunchStats *launch_stats = NULL;
+int placeholder_timer = -1;  // timerfd for PLACEHOLDER_TIMEOUT_MS
+int signal_fd = -1;          // signalfd for SIGCHLD and SIGUSR1
+int epoll_fd = -1;
+int ipc_fd = -1;             // Listening socket, -1 if it could not be set up
+char ipc_path[108];
+IpcClient *ipc_clients = NULL;
+int subscribers = 0;
+Snapshot *snapshot = NULL;   // NULL if the segment could not be set up
+char snapshot_name[80];
+int snapshot_dirty = 1;
+HandlerStats handlers[HANDLER_LAST];
+const char *handler_names[HANDLER_LAST] = {
+    [MapRequest] = "MapRequest",
+    [UnmapNotify] = "UnmapNotify",
+    [DestroyNotify] = "DestroyNotify",
+    [ConfigureRequest] = "ConfigureRequest",
+    [EnterNotify] = "EnterNotify",
+    [FocusIn] = "FocusIn",
+    [PropertyNotify] = "PropertyNotify",
+    [KeyPress] = "KeyPress",
+    [HANDLER_PENDING] = "manage_pending",
+    [HANDLER_LAYOUT] = "arrange",
+    [HANDLER_IPC] = "ipc",
+    [HANDLER_OTHER] = "other",
+};
+Child *children = NULL;      // Still running
+Child exited[CHILD_HISTORY]; // Ring of the most recently reaped
+unsigned long exited_count = 0;
+unsigned long launch_seq = 0;
+Stats stats;
+
+// Window -> Client index: open addressing with linear probing.
+// Deletion uses backward shifting, so there are no tombstones.
+Client **client_table = NULL;
+size_t client_table_cap = 0;
+size_t client_table_len = 0;
 int cur_ws = 0;
 int running = 1;
+int layout_now = 0;     // Skip the coalescing window (user actions)
+int layout_timer = -1;  // timerfd for RELAYOUT_DELAY_MS
+int layout_armed = 0;
 Atom wm_protocols, wm_delete_window, wm_take_focus;
+Atom netatom[NetLast];
+Window wm_check;  // _NET_SUPPORTING_WM_CHECK window
 
 // Terminal classes for WS0
 const char *terminal_classes[] = {
@@ -42,382 +415,2718 @@ const char *browser_classes[] = {
     "Google-chrome", "google-chrome", "Brave-browser", NULL
 };
 
+// Classes kept mapped and moved off-screen while their workspace is hidden.
+// Heavy browsers rebuild their surfaces after an unmap, a move is cheap.
+const char *parked_classes[] = {
+    "firefox", "Chromium", "Google-chrome", "Brave-browser", NULL
+};
+
+// Lowercased class name -> workspace, built once from the lists above
+typedef struct {
+    char *name;
+    int workspace;
+    int park;
+} ClassEntry;
+
+ClassEntry class_table[CLASS_TABLE_SIZE];
+
 void die(const char *s) {
     perror(s);
     exit(1);
 }
 
-int match_class(Window w, const char **classes) {
-    XClassHint ch;
-    if (!XGetClassHint(dpy, w, &ch)) return 0;
+int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB) return v;
+    int msb = 63 - __builtin_clzll(v);
+    if (msb >= HIST_MAX_BITS) return HIST_BUCKETS - 1;
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
 
-    int match = 0;
-    if (ch.res_class || ch.res_name) {
-        for (const char **p = classes; *p; ++p) {
-            if ((ch.res_class && strcasecmp(ch.res_class, *p) == 0) ||
-                (ch.res_name && strcasecmp(ch.res_name, *p) == 0)) {
-                match = 1;
-                break;
-            }
+// Smallest value that lands in bucket i
+uint64_t hist_bucket_floor(int i) {
+    if (i < HIST_SUB) return i;
+    int shift = i / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+}
+
+void hist_record(Histogram *h, uint64_t v) {
+    h->buckets[hist_bucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+// Upper edge of the bucket holding the pct-th percentile
+uint64_t hist_percentile(const Histogram *h, double pct) {
+    if (!h->count) return 0;
+    uint64_t rank = (uint64_t)(h->count * pct / 100.0 + 0.5), seen = 0;
+    if (rank < 1) rank = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t top = i + 1 < HIST_BUCKETS ? hist_bucket_floor(i + 1) - 1 : h->max;
+            return top < h->max ? top : h->max;
         }
     }
+    return h->max;
+}
 
-    if (ch.res_name) XFree(ch.res_name);
-    if (ch.res_class) XFree(ch.res_class);
-    return match;
+void dump_histogram(FILE *f, const char *name, const Histogram *h) {
+    fprintf(f, "%s count %llu avg %llu p50 %llu p90 %llu p99 %llu max %llu\n", name,
+            (unsigned long long)h->count,
+            (unsigned long long)(h->count ? h->sum / h->count : 0),
+            (unsigned long long)hist_percentile(h, 50),
+            (unsigned long long)hist_percentile(h, 90),
+            (unsigned long long)hist_percentile(h, 99),
+            (unsigned long long)h->max);
 }
 
-int get_window_workspace(Window w) {
-    if (match_class(w, terminal_classes)) return 0;
-    if (match_class(w, browser_classes)) return 1;
-    return -1; // Not allowed
+// FNV-1a over the lowercased string
+uint32_t class_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const char *p = name; *p; p++)
+        h = (h ^ (unsigned char)tolower((unsigned char)*p)) * 16777619u;
+    return h;
 }
 
-Client* find_client(Window w) {
-    for (Client *c = clients; c; c = c->next)
-        if (c->w == w) return c;
+void add_classes(const char **classes, int workspace) {
+    for (const char **p = classes; *p; ++p) {
+        size_t i = class_hash(*p) & (CLASS_TABLE_SIZE - 1);
+        int dup = 0;
+        while (class_table[i].name) {
+            if (strcasecmp(class_table[i].name, *p) == 0) {
+                dup = 1;  // First list wins, as with the old linear scan
+                break;
+            }
+            i = (i + 1) & (CLASS_TABLE_SIZE - 1);
+        }
+        if (dup) continue;
+
+        char *name = strdup(*p);
+        if (!name) die("strdup");
+        for (char *q = name; *q; q++) *q = tolower((unsigned char)*q);
+        class_table[i].name = name;
+        class_table[i].workspace = workspace;
+        class_table[i].park = 0;
+    }
+}
+
+ClassEntry *lookup_class(const char *name) {
+    if (!name) return NULL;
+    for (size_t i = class_hash(name) & (CLASS_TABLE_SIZE - 1);
+         class_table[i].name; i = (i + 1) & (CLASS_TABLE_SIZE - 1))
+        if (strcasecmp(class_table[i].name, name) == 0)
+            return &class_table[i];
     return NULL;
 }
 
-void add_client(Window w, int workspace) {
-    Client *c = malloc(sizeof(Client));
-    c->w = w;
-    c->workspace = workspace;
-    c->next = clients;
-    clients = c;
+// Only classes already allowed on a workspace can be parked
+void set_parked_classes(const char **classes) {
+    for (const char **p = classes; *p; ++p) {
+        ClassEntry *ce = lookup_class(*p);
+        if (ce) ce->park = 1;
+    }
+}
 
-    XSetWindowBorderWidth(dpy, w, BORDER_WIDTH);
-    XSelectInput(dpy, w, EnterWindowMask | FocusChangeMask | PropertyChangeMask);
+xcb_get_property_cookie_t get_property(Window w, Atom prop, Atom type, uint32_t len) {
+    return xcb_get_property(xcb, 0, w, prop, type, 0, len);
 }
 
-void remove_client(Window w) {
-    Client **pp = &clients;
-    while (*pp) {
-        if ((*pp)->w == w) {
-            Client *tmp = *pp;
-            *pp = tmp->next;
-            free(tmp);
-            return;
-        }
-        pp = &(*pp)->next;
+// NULL means the request failed, usually because the window is gone.
+// Only replies that are not in yet count as a round trip.
+xcb_get_property_reply_t *property_reply(xcb_get_property_cookie_t cookie) {
+    xcb_generic_error_t *err = NULL;
+    void *r = NULL;
+    if (!xcb_poll_for_reply(xcb, cookie.sequence, &r, &err)) {
+        stats.round_trips++;
+        r = xcb_get_property_reply(xcb, cookie, &err);
     }
+    free(err);
+    return r;
 }
 
-void set_border(Window w, unsigned long color) {
-    XSetWindowBorder(dpy, w, color);
+// WM_CLASS holds "instance\0class\0"; terminals win when the two disagree.
+// NULL means the window is not allowed.
+ClassEntry *classify_window(xcb_get_property_reply_t *r) {
+    char buf[256];
+    int len = xcb_get_property_value_length(r);
+    if (r->format != 8 || len <= 0) return NULL;
+    if (len > (int)sizeof(buf) - 1) len = sizeof(buf) - 1;
+    memcpy(buf, xcb_get_property_value(r), len);
+    buf[len] = '\0';
+
+    const char *res_name = buf;
+    size_t name_len = strlen(res_name);
+    const char *res_class = (int)name_len + 1 < len ? buf + name_len + 1 : NULL;
+
+    ClassEntry *by_class = lookup_class(res_class);
+    ClassEntry *by_name = lookup_class(res_name);
+
+    if (!by_class) return by_name;
+    if (!by_name) return by_class;
+    return by_class->workspace <= by_name->workspace ? by_class : by_name;
 }
 
-int supports_protocol(Window w, Atom protocol) {
-    Atom *protocols;
-    int count, ret = 0;
-    if (XGetWMProtocols(dpy, w, &protocols, &count)) {
-        for (int i = 0; i < count; i++) {
-            if (protocols[i] == protocol) {
-                ret = 1;
-                break;
-            }
-        }
-        XFree(protocols);
-    }
-    return ret;
+size_t client_slot(Window w) {
+    // Fibonacci hashing; XIDs are clustered per X client so mix them up
+    return (size_t)(((unsigned long long)w * 0x9E3779B97F4A7C15ULL) >> 32)
+           & (client_table_cap - 1);
 }
 
-void set_focus(Window w) {
-    if (w == None) {
-        XSetInputFocus(dpy, root, RevertToPointerRoot, CurrentTime);
-        return;
+void client_table_insert(Client *c) {
+    size_t i = client_slot(c->w);
+    while (client_table[i])
+        i = (i + 1) & (client_table_cap - 1);
+    client_table[i] = c;
+    client_table_len++;
+}
+
+void client_table_grow() {
+    Client **old = client_table;
+    size_t old_cap = client_table_cap;
+
+    client_table_cap = old_cap ? old_cap * 2 : CLIENT_TABLE_MIN;
+    client_table = calloc(client_table_cap, sizeof(Client *));
+    if (!client_table) die("calloc");
+    client_table_len = 0;
+
+    for (size_t i = 0; i < old_cap; i++)
+        if (old[i]) client_table_insert(old[i]);
+    free(old);
+}
+
+void client_table_remove(Client *c) {
+    size_t mask = client_table_cap - 1;
+    size_t i = client_slot(c->w);
+    while (client_table[i] != c) {
+        if (!client_table[i]) return;
+        i = (i + 1) & mask;
     }
 
-    // Unfocus all windows first
-    for (Client *c = clients; c; c = c->next) {
-        if (c->workspace == cur_ws)
-            set_border(c->w, BORDER_UNFOCUS);
+    // Shift following entries of the probe run back into the hole
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; client_table[j]; j = (j + 1) & mask) {
+        size_t home = client_slot(client_table[j]->w);
+        // Move j into the hole unless its home lies cyclically in (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            client_table[hole] = client_table[j];
+            hole = j;
+        }
     }
+    client_table[hole] = NULL;
+    client_table_len--;
+}
 
-    set_border(w, BORDER_FOCUS);
-    XSetInputFocus(dpy, w, RevertToPointerRoot, CurrentTime);
-    XRaiseWindow(dpy, w);
+Client* find_client(Window w) {
+    if (!client_table_len) return NULL;
+    for (size_t i = client_slot(w); client_table[i];
+         i = (i + 1) & (client_table_cap - 1))
+        if (client_table[i]->w == w) return client_table[i];
+    return NULL;
+}
 
-    if (supports_protocol(w, wm_take_focus)) {
-        XClientMessageEvent ev = {0};
-        ev.type = ClientMessage;
-        ev.window = w;
-        ev.message_type = wm_protocols;
-        ev.format = 32;
-        ev.data.l[0] = wm_take_focus;
-        ev.data.l[1] = CurrentTime;
-        XSendEvent(dpy, w, False, NoEventMask, (XEvent *)&ev);
-    }
+void attach(Client *c) {
+    Workspace *ws = &workspaces[c->workspace];
+    c->prev = NULL;
+    c->next = ws->head;
+    if (ws->head) ws->head->prev = c;
+    else ws->tail = c;
+    ws->head = c;
+    ws->count++;
 }
 
-void arrange() {
-    // Count windows in current workspace
-    int count = 0;
-    for (Client *c = clients; c; c = c->next)
-        if (c->workspace == cur_ws) count++;
+void mark_dirty(int ws) {
+    workspaces[ws].dirty = 1;
+}
 
-    if (count == 0) {
-        set_focus(None);
-        return;
-    }
+// c takes over the list slot of the placeholder ph
+void swap_in(Client *ph, Client *c) {
+    Workspace *ws = &workspaces[ph->workspace];
+    c->prev = ph->prev;
+    c->next = ph->next;
+    if (c->prev) c->prev->next = c;
+    else ws->head = c;
+    if (c->next) c->next->prev = c;
+    else ws->tail = c;
+}
 
-    // Tile windows horizontally
-    int tile_w = screen_w / count;
-    int i = 0;
-    Client *focused = NULL;
-
-    for (Client *c = clients; c; c = c->next) {
-        if (c->workspace == cur_ws) {
-            int x = i * tile_w;
-            int w = (i == count - 1) ? (screen_w - x) : tile_w;
-            XMoveResizeWindow(dpy, c->w, x, 0,
-                            w - 2 * BORDER_WIDTH,
-                            screen_h - 2 * BORDER_WIDTH);
-            XMapWindow(dpy, c->w);
-            if (i == 0) focused = c;
-            i++;
-        } else {
-            XUnmapWindow(dpy, c->w);
-        }
+void detach(Client *c) {
+    Workspace *ws = &workspaces[c->workspace];
+    if (c->prev) c->prev->next = c->next;
+    else ws->head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    else ws->tail = c->prev;
+    c->next = c->prev = NULL;
+    ws->count--;
+}
+
+void drop_placeholder(Client *ph) {
+    mark_dirty(ph->workspace);
+    detach(ph);
+    free(ph);
+}
+
+unsigned int protocols_from_reply(xcb_get_property_reply_t *r) {
+    unsigned int flags = 0;
+    if (!r || r->type != XCB_ATOM_ATOM || r->format != 32) return 0;
+
+    xcb_atom_t *atoms = xcb_get_property_value(r);
+    int count = xcb_get_property_value_length(r) / sizeof(xcb_atom_t);
+    for (int i = 0; i < count; i++) {
+        if (atoms[i] == wm_take_focus)
+            flags |= PROTO_TAKE_FOCUS;
+        else if (atoms[i] == wm_delete_window)
+            flags |= PROTO_DELETE_WINDOW;
     }
+    return flags;
+}
 
-    if (focused) set_focus(focused->w);
-    XSync(dpy, False);
+// NULL if the property is missing or not 8-bit text
+const char *string_from_reply(xcb_get_property_reply_t *r, char *buf, size_t size) {
+    if (!r || r->format != 8) return NULL;
+    int len = xcb_get_property_value_length(r);
+    if (len <= 0) return NULL;
+    if ((size_t)len >= size) len = size - 1;
+    memcpy(buf, xcb_get_property_value(r), len);
+    buf[len] = '\0';
+    return buf;
 }
 
-void focus_next() {
-    Client *cur = NULL, *first = NULL, *next = NULL;
-    Window focused_w;
-    int revert;
-    XGetInputFocus(dpy, &focused_w, &revert);
-
-    // Find current focused and build list
-    for (Client *c = clients; c; c = c->next) {
-        if (c->workspace != cur_ws) continue;
-        if (!first) first = c;
-        if (cur) {
-            next = c;
-            break;
+pid_t pid_from_reply(xcb_get_property_reply_t *r) {
+    if (!r || r->type != XCB_ATOM_CARDINAL || r->format != 32 ||
+        xcb_get_property_value_length(r) < 4)
+        return 0;
+    return *(uint32_t *)xcb_get_property_value(r);
+}
+
+// Refetched only when the WM_PROTOCOLS property changes
+void update_protocols(Client *c) {
+    xcb_get_property_reply_t *r =
+        property_reply(get_property(c->w, wm_protocols, XCB_ATOM_ATOM, PROTOCOLS_MAX));
+    c->protocols = protocols_from_reply(r);
+    free(r);
+}
+
+// Queue a line-delimited JSON event for subscribers of ev, or only for
+// one client. Full buffers drop the event; the subscriber is told how
+// many it missed once there is room again. Nothing here blocks.
+void publish_to(IpcClient *only, unsigned ev, const char *fmt, ...) {
+    // Anything worth an event also changes the shared snapshot
+    if (!only) snapshot_dirty = 1;  // Silent changes mark it themselves
+    if (!subscribers) return;
+
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0 || len >= (int)sizeof(line)) return;
+    stats.events_published++;
+
+    for (IpcClient *ic = only ? only : ipc_clients; ic; ic = only ? NULL : ic->next) {
+        if (!(ic->events & ev)) continue;
+        char note[64];
+        int n = ic->dropped ? snprintf(note, sizeof(note),
+                                       "{\"event\":\"overflow\",\"dropped\":%lu}\n",
+                                       ic->dropped) : 0;
+        if (ic->out_len + n + len > SUB_BUF) {
+            ic->dropped++;
+            stats.events_dropped++;
+            continue;
         }
-        if (c->w == focused_w) cur = c;
+        memcpy(ic->out + ic->out_len, note, n);
+        memcpy(ic->out + ic->out_len + n, line, len);
+        ic->out_len += n + len;
+        ic->dropped = 0;
     }
+}
+
+#define publish(...) publish_to(NULL, __VA_ARGS__)
 
-    // Cycle to next (or wrap to first)
-    if (next) set_focus(next->w);
-    else if (first) set_focus(first->w);
+void event_workspace(IpcClient *to) {
+    publish_to(to, EVENT_WORKSPACE, "{\"event\":\"workspace\",\"ws\":%d}\n", cur_ws + 1);
 }
 
-void focus_prev() {
-    Client *cur = NULL, *first = NULL, *prev = NULL, *last = NULL;
-    Window focused_w;
-    int revert;
-    XGetInputFocus(dpy, &focused_w, &revert);
+void event_focus(IpcClient *to) {
+    publish_to(to, EVENT_FOCUS, "{\"event\":\"focus\",\"window\":%lu,\"ws\":%d}\n",
+               focused ? focused->w : 0UL, (focused ? focused->workspace : cur_ws) + 1);
+}
 
-    for (Client *c = clients; c; c = c->next) {
-        if (c->workspace != cur_ws) continue;
-        if (!first) first = c;
-        if (c->w == focused_w) cur = c;
-        else if (!cur) prev = c;
-        last = c;
-    }
+void event_client(Client *c, const char *change) {
+    publish(EVENT_CLIENT, "{\"event\":\"client\",\"change\":\"%s\",\"window\":%lu,"
+            "\"ws\":%d,\"pid\":%d}\n", change, c->w, c->workspace + 1, (int)c->pid);
+}
 
-    // Cycle to prev (or wrap to last)
-    if (prev) set_focus(prev->w);
-    else if (last) set_focus(last->w);
+uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-void change_ws(int ws) {
-    if (ws < 0 || ws >= WORKSPACES || ws == cur_ws) return;
-    cur_ws = ws;
-    arrange();
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-void kill_focused() {
-    Window focused_w;
-    int revert;
-    XGetInputFocus(dpy, &focused_w, &revert);
-    if (focused_w == None || focused_w == root) return;
+// XNextRequest() also sees requests sent straight through XCB
+HandlerMark handler_begin() {
+    HandlerMark m = { now_ns(), XNextRequest(dpy), stats.round_trips };
+    return m;
+}
 
-    if (supports_protocol(focused_w, wm_delete_window)) {
-        XClientMessageEvent ev = {0};
-        ev.type = ClientMessage;
-        ev.window = focused_w;
-        ev.message_type = wm_protocols;
-        ev.format = 32;
-        ev.data.l[0] = wm_delete_window;
-        ev.data.l[1] = CurrentTime;
-        XSendEvent(dpy, focused_w, False, NoEventMask, (XEvent *)&ev);
-    } else {
-        XKillClient(dpy, focused_w);
-    }
+// Handlers never nest: arrange() only runs from the main loop itself
+void handler_end(int h, HandlerMark m) {
+    HandlerStats *hs = &handlers[h];
+    hist_record(&hs->latency_ns, now_ns() - m.ns);
+    hs->requests += XNextRequest(dpy) - m.requests;
+    hs->round_trips += stats.round_trips - m.round_trips;
 }
 
-void spawn_cmd(const char *cmd) {
-    if (!cmd) return;
-    if (fork() == 0) {
-        setsid();
-        execl("/bin/sh", "sh", "-c", cmd, NULL);
-        _exit(1);
-    }
+Proc *find_proc(pid_t pid) {
+    for (Proc *p = procs; p; p = p->next)
+        if (p->pid == pid) return p;
+    return NULL;
 }
 
-void handle_maprequest(XEvent *e) {
-    Window w = e->xmaprequest.window;
+int proc_clients(Proc *p) {
+    int n = 0;
+    for (int i = 0; i < WORKSPACES; i++) n += p->nclients[i];
+    return n;
+}
 
-    // Check if already managed
-    if (find_client(w)) return;
+// The fields of /proc/<pid>/stat after comm, which may contain spaces
+const char *proc_stat(pid_t pid, char *buf, size_t size) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    size_t n = fread(buf, 1, size - 1, f);
+    fclose(f);
+    buf[n] = '\0';
 
-    int ws = get_window_workspace(w);
-    if (ws < 0) {
-        // Not allowed - kill it
-        XKillClient(dpy, w);
-        return;
-    }
+    char *p = strrchr(buf, ')');
+    return p && p[1] == ' ' ? p + 2 : NULL;
+}
 
-    add_client(w, ws);
+// utime + stime
+unsigned long long proc_cpu_ticks(pid_t pid) {
+    char buf[1024];
+    const char *p = proc_stat(pid, buf, sizeof(buf));
+    unsigned long long utime = 0, stime = 0;
+    if (!p || sscanf(p, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+                     &utime, &stime) != 2)
+        return 0;
+    return utime + stime;
+}
 
-    // Switch to appropriate workspace if needed
-    if (ws != cur_ws) change_ws(ws);
-    else arrange();
+pid_t proc_parent(pid_t pid) {
+    char buf[1024];
+    const char *p = proc_stat(pid, buf, sizeof(buf));
+    int ppid = 0;
+    if (!p || sscanf(p, "%*c %d", &ppid) != 1) return 0;
+    return ppid;
 }
 
-void handle_unmap(XEvent *e) {
-    Window w = e->xunmap.window;
-    if (e->xunmap.send_event) { // Ignore synthetic events
-        remove_client(w);
-        arrange();
-    }
+// _NET_WM_PID is whatever the client claims, and means nothing for a
+// remote client. It is only believed for a process on this host, owned
+// by us and started by the WM, directly or by something we launched, so
+// no window can get an unrelated process stopped or reniced. 0 otherwise.
+pid_t trusted_pid(pid_t pid, const char *machine) {
+    if (pid <= 1 || !machine || strcmp(machine, hostname) != 0) return 0;
+
+    char path[64];
+    struct stat st;
+    snprintf(path, sizeof(path), "/proc/%d", (int)pid);
+    if (stat(path, &st) < 0 || st.st_uid != getuid()) return 0;
+
+    for (Child *ch = children; ch; ch = ch->next)
+        if (ch->pid == pid) return pid;
+    pid_t self = getpid();
+    for (pid_t p = proc_parent(pid); p > 1; p = proc_parent(p))
+        if (p == self) return pid;
+    return 0;
 }
 
-void handle_destroy(XEvent *e) {
-    Window w = e->xdestroywindow.window;
-    remove_client(w);
-    arrange();
+// The cgroup v2 path ("0::/path") of a process
+int read_cgroup(pid_t pid, char *out, size_t len) {
+    char path[64], line[512];
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+
+    int found = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) != 0) continue;
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(out, len, "%s", line + 3);
+        found = 1;
+        break;
+    }
+    fclose(f);
+    return found;
 }
 
-void handle_configure_request(XEvent *e) {
-    XConfigureRequestEvent *ev = &e->xconfigurerequest;
-    XWindowChanges wc = {
-        .x = ev->x,
-        .y = ev->y,
-        .width = ev->width,
-        .height = ev->height,
-        .border_width = BORDER_WIDTH,
-        .sibling = ev->above,
-        .stack_mode = ev->detail
-    };
-    XConfigureWindow(dpy, ev->window, ev->value_mask, &wc);
+int write_freeze(const char *cgroup, int frozen) {
+    char path[640];
+    snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cgroup.freeze", cgroup);
+    FILE *f = fopen(path, "w");
+    if (!f) return 0;
+    int ok = fputs(frozen ? "1" : "0", f) >= 0;
+    return fclose(f) == 0 && ok;
 }
 
-void handle_enternotify(XEvent *e) {
-    Client *c = find_client(e->xcrossing.window);
-    if (c && c->workspace == cur_ws)
-        set_focus(c->w);
+// The root cgroup or any ancestor of ours is shared with the WM
+int cgroup_shared(const char *cg) {
+    size_t len = strlen(cg);
+    return len <= 1 || (strncmp(own_cgroup, cg, len) == 0 &&
+                        (own_cgroup[len] == '\0' || own_cgroup[len] == '/'));
 }
 
-void grab_keys() {
-    unsigned int mod = Mod4Mask; // Super key
+// A cgroup may only be frozen if it holds neither the WM nor a process
+// with windows on the current workspace
+int cgroup_freezable(const char *cg) {
+    if (cgroup_shared(cg)) return 0;
 
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Return), mod, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_b), mod, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_1), mod, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_2), mod, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_c), mod | ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_q), mod | ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_h), mod, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_l), mod, root, True, GrabModeAsync, GrabModeAsync);
+    char other[512];
+    for (Proc *o = procs; o; o = o->next)
+        if (o->nclients[cur_ws] && read_cgroup(o->pid, other, sizeof(other)) &&
+            strcmp(other, cg) == 0)
+            return 0;
+    return 1;
 }
 
-void setup() {
-    dpy = XOpenDisplay(NULL);
-    if (!dpy) die("Cannot open display");
+// Stop the whole process group when it is the app's own (spawn_cmd()
+// calls setsid()), so helper processes of browsers stop as well
+pid_t signal_target(Proc *p) {
+    pid_t pgid = getpgid(p->pid);
+    if (pgid <= 1 || pgid == getpgrp()) return p->pid;
+    for (Proc *o = procs; o; o = o->next)
+        if (o->nclients[cur_ws] && getpgid(o->pid) == pgid) return p->pid;
+    return -pgid;
+}
 
-    root = DefaultRootWindow(dpy);
-    screen_w = DisplayWidth(dpy, DefaultScreen(dpy));
-    screen_h = DisplayHeight(dpy, DefaultScreen(dpy));
+void freeze_proc(Proc *p) {
+    char cg[512];
+    uint64_t now = now_us();
+    unsigned long long ticks = proc_cpu_ticks(p->pid);
+    if (now > p->sampled_us && ticks >= p->cpu_ticks)
+        p->cpu_rate = (double)(ticks - p->cpu_ticks) / sysconf(_SC_CLK_TCK) /
+                      ((now - p->sampled_us) / 1e6);
 
-    // Check if another WM is running
-    XSetErrorHandler(NULL);
-    XSelectInput(dpy, root, SubstructureRedirectMask | SubstructureNotifyMask);
-    XSync(dpy, False);
+    if (read_cgroup(p->pid, cg, sizeof(cg)) && cgroup_freezable(cg) &&
+        write_freeze(cg, 1)) {
+        p->frozen = FROZEN_CGROUP;
+    } else {
+        p->signal_target = signal_target(p);
+        if (kill(p->signal_target, SIGSTOP) < 0) return;
+        p->frozen = FROZEN_SIGNAL;
+    }
+    p->frozen_us = now;
+    stats.freezes++;
+}
 
-    // Intern atoms
-    wm_protocols = XInternAtom(dpy, "WM_PROTOCOLS", False);
-    wm_delete_window = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
-    wm_take_focus = XInternAtom(dpy, "WM_TAKE_FOCUS", False);
+void thaw_proc(Proc *p) {
+    char cg[512];
+    if (p->frozen == FROZEN_NONE) return;
 
-    grab_keys();
+    if (p->frozen == FROZEN_CGROUP) {
+        if (read_cgroup(p->pid, cg, sizeof(cg))) write_freeze(cg, 0);
+    } else {
+        kill(p->signal_target, SIGCONT);
+    }
+    p->frozen = FROZEN_NONE;
 
-    // Set cursor
-    XDefineCursor(dpy, root, XCreateFontCursor(dpy, 68));
+    uint64_t frozen_ms = (now_us() - p->frozen_us) / 1000;
+    stats.frozen_ms += frozen_ms;
+    stats.cpu_saved_ms += (uint64_t)(p->cpu_rate * frozen_ms);
+    stats.thaws++;
 }
 
-void cleanup() {
-    while (clients) {
-        Client *c = clients;
-        clients = c->next;
-        XUnmapWindow(dpy, c->w);
-        free(c);
+// Mirrors struct sched_attr from the kernel UAPI (glibc has no wrapper)
+struct sched_attr_uclamp {
+    uint32_t size, sched_policy;
+    uint64_t sched_flags;
+    int32_t sched_nice;
+    uint32_t sched_priority;
+    uint64_t sched_runtime, sched_deadline, sched_period;
+    uint32_t sched_util_min, sched_util_max;
+};
+
+void prio_result(int ok) {
+    if (ok) atomic_fetch_add(&stats.prio_adjustments, 1);
+    else atomic_fetch_add(&stats.prio_failures, 1);
+}
+
+// Nice values are per thread on Linux: use the app's own process group
+// when it has one (spawn_cmd() calls setsid()), else every thread of pid
+void apply_nice(pid_t pid, int nice) {
+    pid_t pgid = getpgid(pid);
+    if (pgid > 1 && pgid != getpgrp()) {
+        prio_result(setpriority(PRIO_PGRP, pgid, nice) == 0);
+        return;
     }
-    XCloseDisplay(dpy);
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *d = opendir(path);
+    if (!d) {
+        prio_result(0);
+        return;
+    }
+    for (struct dirent *de; (de = readdir(d));) {
+        if (de->d_name[0] == '.') continue;
+        prio_result(setpriority(PRIO_PROCESS, atoi(de->d_name), nice) == 0);
+    }
+    closedir(d);
 }
 
-void run() {
-    XEvent ev;
-    while (running && !XNextEvent(dpy, &ev)) {
-        switch (ev.type) {
-            case MapRequest:
-                handle_maprequest(&ev);
-                break;
-            case UnmapNotify:
-                handle_unmap(&ev);
-                break;
-            case DestroyNotify:
-                handle_destroy(&ev);
-                break;
-            case ConfigureRequest:
-                handle_configure_request(&ev);
-                break;
-            case EnterNotify:
-                handle_enternotify(&ev);
-                break;
-            case KeyPress: {
-                KeySym k = XLookupKeysym(&ev.xkey, 0);
-                unsigned int state = ev.xkey.state & ~(LockMask | Mod2Mask);
-
-                if (state == Mod4Mask) {
-                    if (k == XK_Return) {
-                        const char *term = getenv("TERMINAL");
-                        if (!term) term = "kitty";
-                        spawn_cmd(term);
-                    } else if (k == XK_b) {
-                        spawn_cmd("firefox");
-                    } else if (k == XK_1) {
-                        change_ws(0);
-                    } else if (k == XK_2) {
-                        change_ws(1);
-                    } else if (k == XK_h) {
-                        focus_prev();
-                    } else if (k == XK_l) {
-                        focus_next();
-                    }
-                } else if (state == (Mod4Mask | ShiftMask)) {
-                    if (k == XK_c) {
-                        kill_focused();
-                    } else if (k == XK_q) {
-                        running = 0;
-                    }
-                }
-                break;
-            }
+void apply_priority(const PrioJob *job) {
+    static const int nice_levels[PRIO_LAST] = {
+        NICE_FOCUSED, NICE_UNFOCUSED, NICE_BACKGROUND
+    };
+    static const int weights[PRIO_LAST] = {
+        WEIGHT_FOCUSED, WEIGHT_UNFOCUSED, WEIGHT_BACKGROUND
+    };
+
+    if (nice_reversible) apply_nice(job->pid, nice_levels[job->prio]);
+
+    if (PRIORITY_CGROUP) {
+        char cg[512], path[640];
+        if (read_cgroup(job->pid, cg, sizeof(cg)) && !cgroup_shared(cg)) {
+            snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.weight", cg);
+            FILE *f = fopen(path, "w");
+            int ok = f && fprintf(f, "%d", weights[job->prio]) > 0;
+            if (f && fclose(f) != 0) ok = 0;
+            prio_result(ok);
         }
     }
+
+    if (PRIORITY_UCLAMP) {
+        struct sched_attr_uclamp attr = {
+            .size = sizeof(attr),
+            .sched_flags = 0x08 | 0x10 | 0x20,  // KEEP_POLICY | KEEP_PARAMS | UTIL_CLAMP_MIN
+            .sched_util_min = job->prio == PRIO_FOCUSED ? UCLAMP_MIN_FOCUSED : 0
+        };
+        prio_result(syscall(SYS_sched_setattr, job->pid, &attr, 0) == 0);
+    }
+}
+
+void *prio_worker(void *arg) {
+    PrioJob jobs[PRIO_QUEUE];
+    (void)arg;
+
+    pthread_mutex_lock(&prio_lock);
+    for (;;) {
+        while (!prio_len && !prio_stop)
+            pthread_cond_wait(&prio_cond, &prio_lock);
+        if (!prio_len) break;
+
+        int n = prio_len;
+        memcpy(jobs, prio_queue, n * sizeof(PrioJob));
+        prio_len = 0;
+        pthread_mutex_unlock(&prio_lock);
+
+        for (int i = 0; i < n; i++) apply_priority(&jobs[i]);
+        pthread_mutex_lock(&prio_lock);
+    }
+    pthread_mutex_unlock(&prio_lock);
+    return NULL;
+}
+
+// Queue only real changes; a pending job for the same pid is overwritten
+void update_priority(Proc *p) {
+    if (!PRIORITY_BOOST) return;
+
+    int prio = focused && focused->pid == p->pid ? PRIO_FOCUSED :
+               p->nclients[cur_ws] ? PRIO_UNFOCUSED : PRIO_BACKGROUND;
+    if (prio == p->prio) return;
+    p->prio = prio;
+
+    pthread_mutex_lock(&prio_lock);
+    int i = 0;
+    while (i < prio_len && prio_queue[i].pid != p->pid) i++;
+    if (i < prio_len) {
+        prio_queue[i].prio = prio;
+    } else if (prio_len < PRIO_QUEUE) {
+        prio_queue[prio_len++] = (PrioJob){ p->pid, prio };
+        stats.prio_queued++;
+    } else {
+        stats.prio_dropped++;
+        p->prio = -1;  // Retried on the next change
+    }
+    pthread_cond_signal(&prio_cond);
+    pthread_mutex_unlock(&prio_lock);
+}
+
+void proc_ref(Client *c) {
+    if (c->pid <= 0) return;
+    Proc *p = find_proc(c->pid);
+    if (!p) {
+        p = calloc(1, sizeof(Proc));
+        if (!p) die("calloc");
+        p->pid = c->pid;
+        p->prio = -1;
+        p->next = procs;
+        procs = p;
+    }
+    p->nclients[c->workspace]++;
+    update_priority(p);
+}
+
+void proc_unref(Client *c) {
+    Proc **pp = &procs;
+    while (*pp && (*pp)->pid != c->pid) pp = &(*pp)->next;
+    if (!*pp) return;
+
+    Proc *p = *pp;
+    p->nclients[c->workspace]--;
+    if (proc_clients(p)) return;
+    thaw_proc(p);
+    *pp = p->next;
+    free(p);
+}
+
+// Thaw everything about to be shown, then give the rest a grace period
+void background_procs(int old) {
+    if (!FREEZE_BACKGROUND) return;
+
+    for (Proc *p = procs; p; p = p->next) {
+        if (p->nclients[cur_ws]) {
+            thaw_proc(p);
+        } else if (p->nclients[old] && p->frozen == FROZEN_NONE) {
+            p->cpu_ticks = proc_cpu_ticks(p->pid);
+            p->sampled_us = now_us();
+        }
+    }
+
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = FREEZE_GRACE_MS / 1000,
+            .tv_nsec = (FREEZE_GRACE_MS % 1000) * 1000000L
+        }
+    };
+    if (timerfd_settime(freeze_timer, 0, &its, NULL) < 0) die("timerfd_settime");
+}
+
+void freeze_timeout() {
+    uint64_t expirations;
+    if (read(freeze_timer, &expirations, sizeof(expirations)) < 0) return;
+
+    for (Proc *p = procs; p; p = p->next)
+        if (!p->nclients[cur_ws] && p->frozen == FROZEN_NONE)
+            freeze_proc(p);
+}
+
+Client *add_client(Window w, const ClassEntry *ce, unsigned int protocols, pid_t pid) {
+    Client *c = malloc(sizeof(Client));
+    if (!c) die("malloc");
+    c->w = w;
+    c->workspace = ce->workspace;
+    c->x = c->y = c->width = c->height = 0;
+    c->mapped = 0;
+    c->protocols = protocols;
+    c->park = ce->park;
+    c->parked = 0;
+    c->net_state = 0;
+    c->pid = pid;
+    c->pooled = 0;
+    c->placeholder = 0;
+    c->launch = NULL;
+    c->launch_us = 0;
+    c->next = c->prev = NULL;
+
+    // Keep load factor at or below 1/2
+    if ((client_table_len + 1) * 2 > client_table_cap) client_table_grow();
+    client_table_insert(c);
+
+    XSetWindowBorderWidth(dpy, w, BORDER_WIDTH);
+    XSetWindowBorder(dpy, w, BORDER_UNFOCUS);
+    return c;
+}
+
+// Put a managed client on its workspace, into the reserved tile if given
+void place_client(Client *c, Client *slot) {
+    if (slot) {
+        swap_in(slot, c);
+        free(slot);
+    } else {
+        attach(c);
+    }
+    proc_ref(c);
+    event_client(c, "add");
+
+    long desktop = c->workspace;
+    XChangeProperty(dpy, c->w, netatom[NetWMDesktop], XA_CARDINAL, 32,
+                    PropModeReplace, (unsigned char *)&desktop, 1);
+
+    // Parked clients stay on the root so they remain viewable when hidden
+    if (c->park) return;
+
+    // Save-set keeps the window alive if we die while it sits in a container
+    XAddToSaveSet(dpy, c->w);
+    XReparentWindow(dpy, c->w, workspaces[c->workspace].container, 0, 0);
+}
+
+void pool_push(Client *c) {
+    c->pooled = 1;
+    c->prev = NULL;
+    c->next = pool;
+    if (pool) pool->prev = c;
+    pool = c;
+    pool_count++;
+}
+
+void pool_unlink(Client *c) {
+    if (c->prev) c->prev->next = c->next;
+    else pool = c->next;
+    if (c->next) c->next->prev = c->prev;
+    c->next = c->prev = NULL;
+    c->pooled = 0;
+    pool_count--;
+}
+
+LaunchStats *launch_stats_for(const char *cmd) {
+    LaunchStats *ls;
+    for (ls = launch_stats; ls; ls = ls->next)
+        if (strncmp(ls->cmd, cmd, sizeof(ls->cmd) - 1) == 0) return ls;
+
+    ls = calloc(1, sizeof(LaunchStats));
+    if (!ls) die("calloc");
+    snprintf(ls->cmd, sizeof(ls->cmd), "%s", cmd);
+    ls->next = launch_stats;
+    launch_stats = ls;
+    return ls;
+}
+
+// Unlink the launch a new window belongs to, dropping stale ones on the way
+Launch *take_launch(pid_t pid, const char *startup_id) {
+    uint64_t now = now_us();
+    Launch **pp = &launches, *found = NULL;
+    while (*pp) {
+        Launch *l = *pp;
+        if (!found && ((pid > 0 && l->pid == pid) ||
+                       (startup_id && strcmp(l->startup_id, startup_id) == 0))) {
+            *pp = l->next;
+            found = l;
+        } else if (now - l->spawned_us > LAUNCH_TIMEOUT_MS * 1000ULL) {
+            *pp = l->next;
+            if (l->pooled) pool_launching--;
+            if (l->placeholder) drop_placeholder(l->placeholder);
+            free(l);
+        } else {
+            pp = &l->next;
+        }
+    }
+    return found;
+}
+
+void remove_client(Window w) {
+    Client *c = find_client(w);
+    if (!c) return;
+
+    client_table_remove(c);
+    if (c->pooled) {
+        pool_unlink(c);
+    } else {
+        event_client(c, "remove");
+        proc_unref(c);
+        detach(c);
+    }
+    if (c == focused) {
+        focused = NULL;
+        event_focus(NULL);
+    }
+    free(c);
+}
+
+// Geometry and map state changes only go out when they differ from the cache
+void move_resize(Client *c, int x, int y, int width, int height) {
+    if (c->parked && c->width && c->width == width && c->height == height) {
+        // Coming back from off-screen is a plain move
+        XMoveWindow(dpy, c->w, x, y);
+        c->parked = 0;
+        c->x = x;
+        c->y = y;
+        snapshot_dirty = 1;
+        stats.parks++;
+        return;
+    }
+    if (!c->parked && c->width && c->x == x && c->y == y &&
+        c->width == width && c->height == height)
+        return;
+    XMoveResizeWindow(dpy, c->w, x, y, width, height);
+    c->parked = 0;
+    c->x = x;
+    c->y = y;
+    c->width = width;
+    c->height = height;
+    snapshot_dirty = 1;
+    stats.moveresizes++;
+}
+
+// Move off-screen but keep the cached tile for the way back
+void park_client(Client *c) {
+    if (c->parked) return;
+    XMoveWindow(dpy, c->w, 2 * screen_w, c->y);
+    c->parked = 1;
+    snapshot_dirty = 1;
+    stats.parks++;
+}
+
+void show_client(Client *c) {
+    if (c->mapped) return;
+    XMapWindow(dpy, c->w);
+    c->mapped = 1;
+    snapshot_dirty = 1;
+    stats.maps++;
+
+    if (c->launch) {
+        hist_record(&c->launch->latency, now_us() - c->launch_us);
+        c->launch = NULL;
+    }
+}
+
+void set_border(Window w, unsigned long color) {
+    XSetWindowBorder(dpy, w, color);
+    stats.borders++;
+}
+
+// Written only when the bits differ from what the client already has, so
+// browsers learn they are invisible and throttle themselves
+void update_net_state(Client *c) {
+    unsigned int state = (c->workspace != cur_ws ? NET_STATE_HIDDEN : 0) |
+                         (c == focused ? NET_STATE_FOCUSED : 0);
+    if (state == c->net_state) return;
+
+    Atom atoms[2];
+    int n = 0;
+    if (state & NET_STATE_HIDDEN) atoms[n++] = netatom[NetWMStateHidden];
+    if (state & NET_STATE_FOCUSED) atoms[n++] = netatom[NetWMStateFocused];
+    XChangeProperty(dpy, c->w, netatom[NetWMState], XA_ATOM, 32,
+                    PropModeReplace, (unsigned char *)atoms, n);
+    c->net_state = state;
+    stats.net_states++;
+}
+
+// Only the previously focused client ever carries the focus color
+void focus_borders(Client *c) {
+    if (c == focused) return;
+    Client *old = focused;
+    focused = c;
+    if (old) {
+        set_border(old->w, BORDER_UNFOCUS);
+        update_net_state(old);
+        if (old->pid && (!c || c->pid != old->pid)) {
+            Proc *p = find_proc(old->pid);
+            if (p) update_priority(p);
+        }
+    }
+    if (c) {
+        set_border(c->w, BORDER_FOCUS);
+        update_net_state(c);
+        Proc *p = c->pid ? find_proc(c->pid) : NULL;
+        if (p) update_priority(p);
+    }
+    event_focus(NULL);
+}
+
+void set_focus(Client *c) {
+    if (!c) {
+        focus_borders(NULL);
+        XSetInputFocus(dpy, root, RevertToPointerRoot, CurrentTime);
+        return;
+    }
+    if (c == focused) return;
+
+    Window w = c->w;
+    focus_borders(c);
+    XSetInputFocus(dpy, w, RevertToPointerRoot, CurrentTime);
+    XRaiseWindow(dpy, w);
+
+    if (c->protocols & PROTO_TAKE_FOCUS) {
+        XClientMessageEvent ev = {0};
+        ev.type = ClientMessage;
+        ev.window = w;
+        ev.message_type = wm_protocols;
+        ev.format = 32;
+        ev.data.l[0] = wm_take_focus;
+        ev.data.l[1] = CurrentTime;
+        XSendEvent(dpy, w, False, NoEventMask, (XEvent *)&ev);
+    }
+}
+
+// Only the current workspace is touched; others sit in unmapped containers
+void arrange() {
+    Workspace *ws = &workspaces[cur_ws];
+    int count = ws->count;
+    unsigned long start = XNextRequest(dpy);
+    HandlerMark mark = handler_begin();
+
+    ws->dirty = 0;
+    layout_now = 0;
+    stats.arranges++;
+    publish(EVENT_LAYOUT, "{\"event\":\"layout\",\"ws\":%d,\"tiles\":%d}\n",
+            cur_ws + 1, count);
+    if (count == 0) {
+        set_focus(NULL);
+        stats.last_arrange_requests = XNextRequest(dpy) - start;
+        handler_end(HANDLER_LAYOUT, mark);
+        return;
+    }
+
+    // Tile windows horizontally
+    int tile_w = screen_w / count;
+    int i = 0;
+
+    Client *first = NULL;
+
+    for (Client *c = ws->head; c; c = c->next, i++) {
+        int x = i * tile_w;
+        int w = (i == count - 1) ? (screen_w - x) : tile_w;
+        if (c->placeholder) continue;  // Keeps its slot, nothing to send
+        move_resize(c, x, 0,
+                    w - 2 * BORDER_WIDTH,
+                    screen_h - 2 * BORDER_WIDTH);
+        show_client(c);
+        update_net_state(c);
+        if (!first) first = c;
+    }
+
+    // Focus moved earlier in the batch stays; the head is only a fallback
+    set_focus(focused && focused->workspace == cur_ws ? focused : first);
+    stats.last_arrange_requests = XNextRequest(dpy) - start;
+    handler_end(HANDLER_LAYOUT, mark);
+}
+
+void focus_next() {
+    Client *cur = focused && focused->workspace == cur_ws ? focused : NULL;
+    Client *c = cur ? cur->next : NULL;
+
+    // Cycle to next (or wrap to first), stepping over reserved tiles
+    for (int n = workspaces[cur_ws].count; n > 0; n--, c = c->next) {
+        if (!c) c = workspaces[cur_ws].head;
+        if (!c->placeholder) {
+            set_focus(c);
+            return;
+        }
+    }
+}
+
+void focus_prev() {
+    Client *cur = focused && focused->workspace == cur_ws ? focused : NULL;
+    Client *c = cur ? cur->prev : NULL;
+
+    // Cycle to prev (or wrap to last), stepping over reserved tiles
+    for (int n = workspaces[cur_ws].count; n > 0; n--, c = c->prev) {
+        if (!c) c = workspaces[cur_ws].tail;
+        if (!c->placeholder) {
+            set_focus(c);
+            return;
+        }
+    }
+}
+
+void change_ws(int ws) {
+    if (ws < 0 || ws >= WORKSPACES || ws == cur_ws) return;
+    unsigned long start = XNextRequest(dpy);
+
+    int old = cur_ws;
+    cur_ws = ws;
+    event_workspace(NULL);
+
+    // The layout pass is deferred; until it runs nothing on the hidden
+    // workspace may stay the target of kill or focus cycling
+    if (focused && focused->workspace != cur_ws) focus_borders(NULL);
+
+    // Map the new container before dropping the old one to avoid a flash
+    XMapWindow(dpy, workspaces[ws].container);
+    XUnmapWindow(dpy, workspaces[old].container);
+    for (Client *c = workspaces[old].head; c; c = c->next) {
+        if (c->placeholder) continue;
+        if (c->park) park_client(c);
+        update_net_state(c);
+    }
+
+    long desktop = ws;
+    XChangeProperty(dpy, root, netatom[NetCurrentDesktop], XA_CARDINAL, 32,
+                    PropModeReplace, (unsigned char *)&desktop, 1);
+    stats.switches++;
+    stats.last_switch_requests = XNextRequest(dpy) - start;
+
+    background_procs(old);
+    for (Proc *p = procs; p; p = p->next)
+        update_priority(p);
+
+    mark_dirty(ws);
+    layout_now = 1;
+}
+
+void close_client(Client *c) {
+    if (c->protocols & PROTO_DELETE_WINDOW) {
+        XClientMessageEvent ev = {0};
+        ev.type = ClientMessage;
+        ev.window = c->w;
+        ev.message_type = wm_protocols;
+        ev.format = 32;
+        ev.data.l[0] = wm_delete_window;
+        ev.data.l[1] = CurrentTime;
+        XSendEvent(dpy, c->w, False, NoEventMask, (XEvent *)&ev);
+    } else {
+        XKillClient(dpy, c->w);
+    }
+}
+
+void kill_focused() {
+    if (!focused) return;
+    close_client(focused);
+}
+
+extern char **environ;
+
+void child_add(pid_t pid, const char *cmd, LaunchStats *ls, uint64_t start) {
+    Child *ch = calloc(1, sizeof(Child));
+    if (!ch) die("calloc");
+    ch->pid = pid;
+    snprintf(ch->cmd, sizeof(ch->cmd), "%s", cmd);
+    ch->stats = ls;
+    ch->start_us = start;
+    ch->next = children;
+    children = ch;
+}
+
+// posix_spawn() is a vfork-style launch: no copy of our page tables, and
+// the X socket is close-on-exec. Commands without shell syntax are run
+// directly, so the returned pid is also the one in _NET_WM_PID. The launch
+// is remembered until its window maps, for spawn-to-map latency.
+Launch *spawn_cmd(const char *cmd, int pooled) {
+    if (!cmd) return NULL;
+    uint64_t start = now_us();
+
+    Launch *l = calloc(1, sizeof(Launch));
+    if (!l) die("calloc");
+    snprintf(l->startup_id, sizeof(l->startup_id), "madawm%d-%lu_TIME0",
+             (int)getpid(), ++launch_seq);
+
+    // Startup notification: toolkits copy this into _NET_STARTUP_ID
+    char startup_env[96];
+    size_t nenv = 0;
+    while (environ[nenv]) nenv++;
+    char **envp = malloc((nenv + 2) * sizeof(char *));
+    if (!envp) die("malloc");
+    size_t n = 0;
+    for (size_t i = 0; i < nenv; i++)
+        if (strncmp(environ[i], "DESKTOP_STARTUP_ID=", 19) != 0)
+            envp[n++] = environ[i];
+    snprintf(startup_env, sizeof(startup_env), "DESKTOP_STARTUP_ID=%s", l->startup_id);
+    envp[n++] = startup_env;
+    envp[n] = NULL;
+
+    char buf[512];
+    char *argv[SPAWN_ARGS_MAX + 1];
+    int argc = 0;
+    if (strlen(cmd) < sizeof(buf) && !strpbrk(cmd, "|&;<>()$`\\\"'*?[#~=%\n")) {
+        strcpy(buf, cmd);
+        for (char *tok = strtok(buf, " \t"); tok && argc < SPAWN_ARGS_MAX;
+             tok = strtok(NULL, " \t"))
+            argv[argc++] = tok;
+    }
+    int shell = argc == 0 || argc == SPAWN_ARGS_MAX;
+    if (shell) {
+        argv[0] = "sh";
+        argv[1] = "-c";
+        argv[2] = (char *)cmd;
+        argc = 3;
+    }
+    argv[argc] = NULL;
+
+    // Children get default signal handling and an empty mask back
+    posix_spawnattr_t attr;
+    sigset_t none, def;
+    sigemptyset(&none);
+    sigemptyset(&def);
+    sigaddset(&def, SIGCHLD);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK |
+                                    POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &def);
+
+    pid_t pid;
+    int err = shell ? posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, envp)
+                    : posix_spawnp(&pid, argv[0], NULL, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+    free(envp);
+
+    stats.spawns++;
+    stats.spawn_us += now_us() - start;
+    if (err) {
+        errno = err;
+        perror("posix_spawn");
+        free(l);
+        return NULL;
+    }
+
+    l->pid = pid;
+    l->pooled = pooled;
+    l->stats = pooled ? NULL : launch_stats_for(cmd);
+    l->spawned_us = start;
+    l->next = launches;
+    launches = l;
+    child_add(pid, cmd, l->stats, start);
+    return l;
+}
+
+// Fire PLACEHOLDER_TIMEOUT_MS after the oldest outstanding reservation
+void arm_placeholder_timer() {
+    uint64_t oldest = 0;
+    for (Launch *l = launches; l; l = l->next)
+        if (l->placeholder && (!oldest || l->spawned_us < oldest))
+            oldest = l->spawned_us;
+
+    struct itimerspec its = {0};
+    if (oldest) {
+        uint64_t due = oldest + PLACEHOLDER_TIMEOUT_MS * 1000ULL, now = now_us();
+        uint64_t wait = due > now ? due - now : 1;
+        its.it_value.tv_sec = wait / 1000000;
+        its.it_value.tv_nsec = (wait % 1000000) * 1000;
+    }
+    if (timerfd_settime(placeholder_timer, 0, &its, NULL) < 0) die("timerfd_settime");
+}
+
+// The app never showed up; give its tile back
+void placeholder_timeout() {
+    uint64_t expirations, now = now_us();
+    if (read(placeholder_timer, &expirations, sizeof(expirations)) < 0) return;
+
+    for (Launch *l = launches; l; l = l->next) {
+        if (l->placeholder &&
+            now - l->spawned_us >= PLACEHOLDER_TIMEOUT_MS * 1000ULL) {
+            drop_placeholder(l->placeholder);
+            l->placeholder = NULL;
+            stats.placeholders_expired++;
+        }
+    }
+    arm_placeholder_timer();
+}
+
+uint64_t rusage_us(const struct rusage *ru) {
+    return (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000ULL +
+           ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+}
+
+// A failed child will not map a window: forget its launch and free its tile
+void abandon_launch(pid_t pid) {
+    for (Launch **pp = &launches; *pp; pp = &(*pp)->next) {
+        Launch *l = *pp;
+        if (l->pid != pid) continue;
+        *pp = l->next;
+        if (l->pooled) pool_launching--;
+        if (l->placeholder) {
+            drop_placeholder(l->placeholder);
+            arm_placeholder_timer();
+        }
+        free(l);
+        return;
+    }
+}
+
+void child_exited(pid_t pid, int status, const struct rusage *ru) {
+    Child **pp = &children;
+    while (*pp && (*pp)->pid != pid) pp = &(*pp)->next;
+    if (!*pp) return;  // Not one of ours
+    Child *ch = *pp;
+    *pp = ch->next;
+
+    ch->end_us = now_us();
+    ch->status = status;
+    ch->ru = *ru;
+    ch->next = NULL;
+
+    int failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    int early = failed && ch->end_us - ch->start_us < EARLY_EXIT_MS * 1000ULL;
+    stats.child_exits++;
+    if (failed) stats.child_failures++;
+    if (early) stats.early_exits++;
+    if (ch->stats) {
+        ch->stats->exits++;
+        ch->stats->early_exits += early;
+        ch->stats->cpu_us += rusage_us(ru);
+    }
+    if (failed) abandon_launch(pid);
+
+    exited[exited_count++ % CHILD_HISTORY] = *ch;
+    free(ch);
+}
+
+// One SIGCHLD may stand for several exits, so reap until nothing is left
+void reap_children() {
+    pid_t pid;
+    int status;
+    struct rusage ru;
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0)
+        child_exited(pid, status, &ru);
+}
+
+void dump_children(FILE *f) {
+    uint64_t now = now_us();
+    for (Child *ch = children; ch; ch = ch->next)
+        fprintf(f, "child %d running %llums %s\n", (int)ch->pid,
+                (unsigned long long)(now - ch->start_us) / 1000, ch->cmd);
+
+    unsigned long n = exited_count < CHILD_HISTORY ? exited_count : CHILD_HISTORY;
+    for (unsigned long i = exited_count - n; i < exited_count; i++) {
+        Child *ch = &exited[i % CHILD_HISTORY];
+        char how[32];
+        if (WIFSIGNALED(ch->status))
+            snprintf(how, sizeof(how), "signal=%d", WTERMSIG(ch->status));
+        else
+            snprintf(how, sizeof(how), "exit=%d", WEXITSTATUS(ch->status));
+        fprintf(f, "child %d %s %llums cpu=%llums rss=%ldkB %s\n", (int)ch->pid, how,
+                (unsigned long long)(ch->end_us - ch->start_us) / 1000,
+                (unsigned long long)rusage_us(&ch->ru) / 1000,
+                ch->ru.ru_maxrss, ch->cmd);
+    }
+}
+
+// Launch from a keybinding and reserve the tile the app will land in, so
+// the workspace reflows once while the app starts and not again on map
+void spawn_tiled(const char *cmd) {
+    Launch *l = spawn_cmd(cmd, 0);
+    if (!l) return;
+
+    // The program name decides the workspace, like WM_CLASS will later
+    char prog[64];
+    size_t len = strcspn(cmd, " \t");
+    if (len >= sizeof(prog)) return;
+    memcpy(prog, cmd, len);
+    prog[len] = '\0';
+    char *base = strrchr(prog, '/');
+    ClassEntry *ce = lookup_class(base ? base + 1 : prog);
+    if (!ce) return;
+
+    Client *ph = calloc(1, sizeof(Client));
+    if (!ph) die("calloc");
+    ph->w = None;
+    ph->workspace = ce->workspace;
+    ph->placeholder = 1;
+    attach(ph);
+    mark_dirty(ph->workspace);
+    if (ph->workspace == cur_ws) layout_now = 1;
+
+    l->placeholder = ph;
+    stats.placeholders++;
+    arm_placeholder_timer();
+}
+
+const char *terminal_cmd() {
+    const char *term = getenv("TERMINAL");
+    return term ? term : "kitty";
+}
+
+// Keep TERMINAL_POOL warm terminals around; their windows are recognised
+// through _NET_WM_PID, so $TERMINAL should not need the shell
+void fill_pool() {
+    while (pool_count + pool_launching < TERMINAL_POOL) {
+        if (!spawn_cmd(terminal_cmd(), 1)) return;
+        pool_launching++;
+    }
+}
+
+// Super+Enter: show a warm terminal if there is one, else start one
+void spawn_terminal() {
+    if (!pool) {
+        if (TERMINAL_POOL) stats.pool_misses++;
+        spawn_tiled(terminal_cmd());
+        fill_pool();
+        return;
+    }
+
+    Client *c = pool;
+    pool_unlink(c);
+    place_client(c, NULL);
+    // Pool takes are tracked apart from cold starts of the same command
+    char key[64];
+    snprintf(key, sizeof(key), "pool:%s", terminal_cmd());
+    c->launch = launch_stats_for(key);
+    c->launch_us = now_us();
+    stats.pool_hits++;
+
+    if (c->workspace != cur_ws) change_ws(c->workspace);
+    mark_dirty(c->workspace);
+    layout_now = 1;
+    fill_pool();
+}
+
+// Only queue the property reads here; manage_pending() collects the
+// replies once the whole batch of events has been handled
+void handle_maprequest(XEvent *e) {
+    Window w = e->xmaprequest.window;
+
+    // Check if already managed
+    if (find_client(w)) return;
+    for (int i = 0; i < npending; i++)
+        if (pending[i].w == w) return;
+
+    if (npending == pending_cap) {
+        pending_cap = pending_cap ? pending_cap * 2 : 16;
+        pending = realloc(pending, pending_cap * sizeof(PendingMap));
+        if (!pending) die("realloc");
+    }
+
+    // Select first so no WM_PROTOCOLS change slips in before the read
+    XSelectInput(dpy, w, EnterWindowMask | FocusChangeMask | PropertyChangeMask);
+
+    PendingMap *p = &pending[npending++];
+    p->w = w;
+    p->gone = 0;
+    p->wm_class = get_property(w, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 64);
+    p->wm_protocols = get_property(w, wm_protocols, XCB_ATOM_ATOM, PROTOCOLS_MAX);
+    p->wm_pid = get_property(w, netatom[NetWMPid], XCB_ATOM_CARDINAL, 1);
+    p->wm_machine = get_property(w, XCB_ATOM_WM_CLIENT_MACHINE, XCB_ATOM_STRING, 64);
+    p->startup_id = get_property(w, netatom[NetStartupId], netatom[NetUTF8String], 16);
+}
+
+// The first reply costs one round trip, the rest of the batch is already in
+void manage_pending() {
+    if (!npending) return;
+    stats.map_batches++;
+    stats.batched_maps += npending;
+
+    for (int i = 0; i < npending; i++) {
+        PendingMap *p = &pending[i];
+        xcb_get_property_reply_t *cls = property_reply(p->wm_class);
+        xcb_get_property_reply_t *proto = property_reply(p->wm_protocols);
+        xcb_get_property_reply_t *pid = property_reply(p->wm_pid);
+        xcb_get_property_reply_t *machine = property_reply(p->wm_machine);
+        xcb_get_property_reply_t *sid = property_reply(p->startup_id);
+
+        if (!p->gone && cls) {
+            ClassEntry *ce = classify_window(cls);
+            if (!ce) {
+                // Not allowed - kill it
+                XKillClient(dpy, p->w);
+            } else {
+                int ws = ce->workspace;
+                char host[256];
+                Client *c = add_client(p->w, ce, protocols_from_reply(proto),
+                                       trusted_pid(pid_from_reply(pid),
+                                                   string_from_reply(machine, host,
+                                                                     sizeof(host))));
+                char startup_id[64];
+                Launch *l = take_launch(c->pid, string_from_reply(sid, startup_id,
+                                                                  sizeof(startup_id)));
+                if (l && l->pooled) {
+                    // Stays unmapped until Super+Enter takes it
+                    pool_launching--;
+                    pool_push(c);
+                } else {
+                    Client *slot = NULL;
+                    if (l) {
+                        c->launch = l->stats;
+                        c->launch_us = l->spawned_us;
+                        slot = l->placeholder;
+                        if (slot && slot->workspace != ws) {
+                            drop_placeholder(slot);
+                            slot = NULL;
+                        }
+                        if (slot) stats.placeholder_hits++;
+                    }
+                    place_client(c, slot);
+
+                    // Switch to appropriate workspace if needed
+                    if (ws != cur_ws) change_ws(ws);
+                    else mark_dirty(ws);
+                }
+                free(l);
+            }
+        }
+        free(cls);
+        free(proto);
+        free(pid);
+        free(machine);
+        free(sid);
+    }
+    npending = 0;
+}
+
+void handle_unmap(XEvent *e) {
+    Client *c = find_client(e->xunmap.window);
+    if (!c) return;
+    if (e->xunmap.send_event) { // Ignore synthetic events
+        // Withdrawn: hand the window back to the root
+        int ws = c->workspace;
+        if (!c->park) {
+            XReparentWindow(dpy, c->w, root, c->x, c->y);
+            XRemoveFromSaveSet(dpy, c->w);
+        }
+        XDeleteProperty(dpy, c->w, netatom[NetWMState]);
+        XDeleteProperty(dpy, c->w, netatom[NetWMDesktop]);
+        remove_client(c->w);
+        mark_dirty(ws);
+    } else {
+        // Keep the map cache honest when a client unmaps itself
+        c->mapped = 0;
+        snapshot_dirty = 1;
+    }
+}
+
+void handle_destroy(XEvent *e) {
+    Window w = e->xdestroywindow.window;
+    for (int i = 0; i < npending; i++)
+        if (pending[i].w == w) pending[i].gone = 1;
+
+    Client *c = find_client(w);
+    if (!c) return;
+
+    int ws = c->workspace;
+    remove_client(c->w);
+    mark_dirty(ws);
+}
+
+void handle_configure_request(XEvent *e) {
+    XConfigureRequestEvent *ev = &e->xconfigurerequest;
+    Client *c = find_client(ev->window);
+
+    // A tiled client is told where it is instead of being moved, so a new
+    // window does not resize itself again right after mapping
+    if (c && !c->pooled && c->width) {
+        XConfigureEvent ce = {
+            .type = ConfigureNotify,
+            .display = dpy,
+            .event = c->w,
+            .window = c->w,
+            .x = c->x,
+            .y = c->y,
+            .width = c->width,
+            .height = c->height,
+            .border_width = BORDER_WIDTH,
+            .above = None,
+            .override_redirect = False
+        };
+        XSendEvent(dpy, c->w, False, StructureNotifyMask, (XEvent *)&ce);
+        stats.configures_denied++;
+        return;
+    }
+
+    XWindowChanges wc = {
+        .x = ev->x,
+        .y = ev->y,
+        .width = ev->width,
+        .height = ev->height,
+        .border_width = BORDER_WIDTH,
+        .sibling = ev->above,
+        .stack_mode = ev->detail
+    };
+    XConfigureWindow(dpy, ev->window, ev->value_mask, &wc);
+
+    // The client moved itself, so our cached geometry is stale
+    if (c) {
+        c->width = 0;
+        snapshot_dirty = 1;
+    }
+}
+
+void handle_enternotify(XEvent *e) {
+    Client *c = find_client(e->xcrossing.window);
+    if (c && c->workspace == cur_ws)
+        set_focus(c);
+}
+
+void handle_focusin(XEvent *e) {
+    XFocusChangeEvent *ev = &e->xfocus;
+    if (ev->mode == NotifyGrab || ev->mode == NotifyUngrab) return;
+    if (ev->detail == NotifyPointer || ev->detail == NotifyInferior) return;
+
+    // A client may take focus on its own, follow it
+    Client *c = find_client(ev->window);
+    if (c && !c->pooled && c->workspace == cur_ws) focus_borders(c);
+}
+
+void handle_propertynotify(XEvent *e) {
+    XPropertyEvent *ev = &e->xproperty;
+    if (ev->atom != wm_protocols) return;
+
+    Client *c = find_client(ev->window);
+    if (c) update_protocols(c);
+}
+
+void grab_keys() {
+    unsigned int mod = Mod4Mask; // Super key
+
+    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Return), mod, root, True, GrabModeAsync, GrabModeAsync);
+    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_b), mod, root, True, GrabModeAsync, GrabModeAsync);
+    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_1), mod, root, True, GrabModeAsync, GrabModeAsync);
+    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_2), mod, root, True, GrabModeAsync, GrabModeAsync);
+    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_c), mod | ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
+    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_q), mod | ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
+    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_h), mod, root, True, GrabModeAsync, GrabModeAsync);
+    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_l), mod, root, True, GrabModeAsync, GrabModeAsync);
+}
+
+// Windows can vanish between an event and our reaction to it
+int xerror(Display *d, XErrorEvent *ee) {
+    (void)d;
+    if (ee->error_code == BadWindow || ee->error_code == BadMatch)
+        return 0;
+    fprintf(stderr, "madawm: X error %d (request %d)\n",
+            ee->error_code, ee->request_code);
+    return 0;
+}
+
+// Add an fd to the main loop; disabled timers (fd -1) are skipped. The fd
+// rides along in the upper half of the event data for IPC connections.
+void watch_fd(int fd, uint32_t tag) {
+    if (fd < 0) return;
+    struct epoll_event ev = { .events = EPOLLIN,
+                              .data.u64 = (uint64_t)fd << 32 | tag };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) die("epoll_ctl");
+}
+
+void dump_stats(FILE *f) {
+    fprintf(f, "arranges %lu\n", stats.arranges);
+    fprintf(f, "moveresizes %lu\n", stats.moveresizes);
+    fprintf(f, "maps %lu\n", stats.maps);
+    fprintf(f, "parks %lu\n", stats.parks);
+    fprintf(f, "borders %lu\n", stats.borders);
+    fprintf(f, "net_states %lu\n", stats.net_states);
+    fprintf(f, "last_arrange_requests %lu\n", stats.last_arrange_requests);
+    fprintf(f, "switches %lu\n", stats.switches);
+    fprintf(f, "last_switch_requests %lu\n", stats.last_switch_requests);
+    fprintf(f, "map_batches %lu\n", stats.map_batches);
+    fprintf(f, "batched_maps %lu\n", stats.batched_maps);
+    fprintf(f, "freezes %lu\n", stats.freezes);
+    fprintf(f, "thaws %lu\n", stats.thaws);
+    fprintf(f, "frozen_ms %llu\n", (unsigned long long)stats.frozen_ms);
+    fprintf(f, "cpu_saved_ms %llu\n", (unsigned long long)stats.cpu_saved_ms);
+    fprintf(f, "prio_queued %lu\n", stats.prio_queued);
+    fprintf(f, "prio_dropped %lu\n", stats.prio_dropped);
+    fprintf(f, "prio_adjustments %lu\n", atomic_load(&stats.prio_adjustments));
+    fprintf(f, "prio_failures %lu\n", atomic_load(&stats.prio_failures));
+    fprintf(f, "spawns %lu\n", stats.spawns);
+    fprintf(f, "spawn_avg_us %llu\n", (unsigned long long)
+            (stats.spawns ? stats.spawn_us / stats.spawns : 0));
+    fprintf(f, "placeholders %lu\n", stats.placeholders);
+    fprintf(f, "placeholder_hits %lu\n", stats.placeholder_hits);
+    fprintf(f, "placeholders_expired %lu\n", stats.placeholders_expired);
+    fprintf(f, "configures_denied %lu\n", stats.configures_denied);
+    fprintf(f, "pool_hits %lu\n", stats.pool_hits);
+    fprintf(f, "pool_misses %lu\n", stats.pool_misses);
+    fprintf(f, "wakeups %lu\n", stats.wakeups);
+    fprintf(f, "x_events %lu\n", stats.x_events);
+    fprintf(f, "budget_overruns %lu\n", stats.budget_overruns);
+    fprintf(f, "idle_ms %llu\n", (unsigned long long)stats.idle_us / 1000);
+    dump_histogram(f, "events_per_wakeup", &stats.events_per_wakeup);
+    fprintf(f, "ipc_connections %lu\n", stats.ipc_connections);
+    fprintf(f, "ipc_commands %lu\n", stats.ipc_commands);
+    fprintf(f, "ipc_errors %lu\n", stats.ipc_errors);
+    fprintf(f, "ipc_dropped %lu\n", stats.ipc_dropped);
+    fprintf(f, "subscribers %d\n", subscribers);
+    fprintf(f, "events_published %lu\n", stats.events_published);
+    fprintf(f, "events_dropped %lu\n", stats.events_dropped);
+    fprintf(f, "snapshots %lu\n", stats.snapshots);
+    fprintf(f, "round_trips %lu\n", stats.round_trips);
+    fprintf(f, "child_exits %lu\n", stats.child_exits);
+    fprintf(f, "child_failures %lu\n", stats.child_failures);
+    fprintf(f, "early_exits %lu\n", stats.early_exits);
+    for (LaunchStats *ls = launch_stats; ls; ls = ls->next) {
+        char name[80];
+        snprintf(name, sizeof(name), "launch_us[%s]", ls->cmd);
+        dump_histogram(f, name, &ls->latency);
+        fprintf(f, "launch_exits[%s] %lu\n", ls->cmd, ls->exits);
+        fprintf(f, "launch_early_exits[%s] %lu\n", ls->cmd, ls->early_exits);
+        fprintf(f, "launch_cpu_ms[%s] %llu\n", ls->cmd,
+                (unsigned long long)ls->cpu_us / 1000);
+    }
+    for (int i = 0; i < HANDLER_LAST; i++) {
+        HandlerStats *hs = &handlers[i];
+        if (!hs->latency_ns.count) continue;
+        char label[32], name[64];
+        if (handler_names[i]) snprintf(label, sizeof(label), "%s", handler_names[i]);
+        else snprintf(label, sizeof(label), "event%d", i);
+        snprintf(name, sizeof(name), "handler_ns[%s]", label);
+        dump_histogram(f, name, &hs->latency_ns);
+        fprintf(f, "handler_requests[%s] %lu\n", label, hs->requests);
+        fprintf(f, "handler_round_trips[%s] %lu\n", label, hs->round_trips);
+    }
+    dump_children(f);
+}
+
+// Everything blocked in setup() arrives here: SIGCHLD reaps, SIGUSR1
+// dumps the counters and histograms to stderr
+void handle_signals() {
+    struct signalfd_siginfo si;
+    int chld = 0;
+    while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGCHLD) chld = 1;
+        else if (si.ssi_signo == SIGUSR1) dump_stats(stderr);
+    }
+    if (chld) reap_children();
+}
+
+// $DISPLAY made safe for use in a file name
+void display_name(char *name, size_t size) {
+    const char *disp = getenv("DISPLAY");
+    size_t n = 0;
+    for (; disp && *disp && n < size - 1; disp++)
+        name[n++] = *disp == '/' ? '_' : *disp;
+    name[n] = '\0';
+}
+
+// $MADAWM_SOCKET, or one socket per display in $XDG_RUNTIME_DIR
+int socket_path(char *buf, size_t size) {
+    const char *env = getenv("MADAWM_SOCKET");
+    if (env && *env) return snprintf(buf, size, "%s", env) < (int)size;
+
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char name[64];
+    display_name(name, sizeof(name));
+    return snprintf(buf, size, "%s/madawm-%s.sock",
+                    dir && *dir ? dir : "/tmp", name) < (int)size;
+}
+
+void ipc_listen() {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (!socket_path(addr.sun_path, sizeof(addr.sun_path))) {
+        fprintf(stderr, "madawm: IPC socket path too long\n");
+        return;
+    }
+    ipc_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ipc_fd < 0) {
+        perror("socket");
+        return;
+    }
+
+    // Left behind by a previous instance on this display
+    unlink(addr.sun_path);
+    mode_t mask = umask(077);
+    int err = bind(ipc_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (err < 0 || listen(ipc_fd, 8) < 0) {
+        perror(addr.sun_path);
+        close(ipc_fd);
+        ipc_fd = -1;
+        return;
+    }
+    strcpy(ipc_path, addr.sun_path);
+    watch_fd(ipc_fd, WatchIpc);
+}
+
+void ipc_accept() {
+    int fd;
+    while ((fd = accept4(ipc_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        IpcClient *ic = calloc(1, sizeof(IpcClient));
+        if (!ic) die("calloc");
+        ic->fd = fd;
+        ic->watching = EPOLLIN;
+        ic->next = ipc_clients;
+        ipc_clients = ic;
+        watch_fd(fd, WatchIpcClient);
+        stats.ipc_connections++;
+    }
+}
+
+void ipc_close(IpcClient *ic) {
+    IpcClient **pp = &ipc_clients;
+    while (*pp != ic) pp = &(*pp)->next;
+    *pp = ic->next;
+    if (ic->events) subscribers--;
+    close(ic->fd);  // Also leaves the epoll set
+    free(ic->out);
+    free(ic);
+}
+
+// Read while the peer still writes, wait for POLLOUT while events are queued
+void ipc_rewatch(IpcClient *ic) {
+    uint32_t want = (ic->eof ? 0 : EPOLLIN) | (ic->out_len ? EPOLLOUT : 0);
+    if (want == ic->watching) return;
+    struct epoll_event ev = { .events = want,
+                              .data.u64 = (uint64_t)ic->fd << 32 | WatchIpcClient };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, ic->fd, &ev) < 0) die("epoll_ctl");
+    ic->watching = want;
+}
+
+// Send as much as fits, never blocking; -1 once the peer is gone
+int ipc_send(int fd, const char *buf, size_t len, size_t *sent) {
+    *sent = 0;
+    while (*sent < len) {
+        ssize_t n = send(fd, buf + *sent, len - *sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno == EAGAIN ? 0 : -1;
+        *sent += n;
+    }
+    return 0;
+}
+
+int ipc_flush(IpcClient *ic) {
+    size_t sent;
+    if (ipc_send(ic->fd, ic->out, ic->out_len, &sent) < 0) return -1;
+    ic->out_len -= sent;
+    memmove(ic->out, ic->out + sent, ic->out_len);
+    ipc_rewatch(ic);
+    return 0;
+}
+
+// Called once per loop iteration, so a burst of events costs one send
+void ipc_flush_all() {
+    for (IpcClient *ic = ipc_clients, *next; ic; ic = next) {
+        next = ic->next;
+        if (ic->out_len && ipc_flush(ic) < 0) ipc_close(ic);
+    }
+}
+
+// subscribe [workspace] [focus] [client] [layout]; none means all. The
+// current workspace and focus are sent right away so bars start in sync.
+int ipc_subscribe(IpcClient *ic, const char *arg) {
+    static const char *names[] = { "workspace", "focus", "client", "layout" };
+    unsigned mask = 0;
+    while (*arg) {
+        size_t len = strcspn(arg, " \t,");
+        unsigned bit = 0;
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+            if (strlen(names[i]) == len && strncmp(arg, names[i], len) == 0)
+                bit = 1u << i;
+        if (!bit) return 0;
+        mask |= bit;
+        arg += len;
+        arg += strspn(arg, " \t,");
+    }
+    if (!mask) mask = EVENT_WORKSPACE | EVENT_FOCUS | EVENT_CLIENT | EVENT_LAYOUT;
+
+    if (!ic->out && !(ic->out = malloc(SUB_BUF))) die("malloc");
+    if (!ic->events) subscribers++;
+    ic->events |= mask;
+    event_workspace(ic);
+    event_focus(ic);
+    return 1;
+}
+
+// Commands only mark workspaces dirty; the whole message costs one
+// layout pass when the loop comes around
+int ipc_exec(IpcClient *ic, const char *cmd, const char *arg, FILE *out) {
+    if (strcmp(cmd, "ws") == 0) {
+        int ws = atoi(arg);
+        if (ws < 1 || ws > WORKSPACES) return 0;
+        change_ws(ws - 1);
+    } else if (strcmp(cmd, "focus") == 0) {
+        if (strcmp(arg, "next") == 0) focus_next();
+        else if (strcmp(arg, "prev") == 0) focus_prev();
+        else return 0;
+    } else if (strcmp(cmd, "kill") == 0) {
+        kill_focused();
+    } else if (strcmp(cmd, "spawn") == 0) {
+        if (!*arg) return 0;
+        spawn_tiled(arg);
+    } else if (strcmp(cmd, "layout") == 0) {
+        mark_dirty(cur_ws);
+        layout_now = 1;
+    } else if (strcmp(cmd, "stats") == 0) {
+        dump_stats(out);
+    } else if (strcmp(cmd, "subscribe") == 0) {
+        return ipc_subscribe(ic, arg);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+void ipc_line(IpcClient *ic, char *line, FILE *out) {
+    line[strcspn(line, "\r")] = '\0';
+    line += strspn(line, " \t");
+    if (!*line) return;
+
+    char *arg = line + strcspn(line, " \t");
+    if (*arg) *arg++ = '\0';
+    arg += strspn(arg, " \t");
+
+    stats.ipc_commands++;
+    if (ipc_exec(ic, line, arg, out)) {
+        fputs("ok\n", out);
+    } else {
+        stats.ipc_errors++;
+        fprintf(out, "error %s\n", line);
+    }
+}
+
+// Run every complete line that arrived and answer them in one write. A
+// client that does not keep up with its replies is disconnected.
+void ipc_read(IpcClient *ic) {
+    int fd = ic->fd;
+    char *reply;
+    size_t reply_len;
+    FILE *out = open_memstream(&reply, &reply_len);
+    if (!out) die("open_memstream");
+
+    int done = 0;
+    for (;;) {
+        ssize_t n = read(fd, ic->in + ic->len, sizeof(ic->in) - ic->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) {
+            // The last line may come without a newline
+            if (ic->len < sizeof(ic->in)) {
+                ic->in[ic->len] = '\0';
+                ipc_line(ic, ic->in, out);
+            }
+            ic->len = 0;
+            if (ic->events && n == 0) ic->eof = 1;  // Keeps receiving events
+            else done = 1;
+            break;
+        }
+        ic->len += n;
+
+        char *line = ic->in, *nl;
+        while ((nl = memchr(line, '\n', ic->in + ic->len - line))) {
+            *nl = '\0';
+            ipc_line(ic, line, out);
+            line = nl + 1;
+        }
+        ic->len -= line - ic->in;
+        memmove(ic->in, line, ic->len);
+        if (ic->len == sizeof(ic->in)) {
+            fputs("error line too long\n", out);
+            stats.ipc_errors++;
+            done = 1;
+            break;
+        }
+    }
+
+    fclose(out);
+    // A subscriber may still have part of an event line queued, so its
+    // replies go behind it, and what the socket does not take now waits
+    // in the same buffer. Others must read their replies as they come.
+    size_t sent = 0;
+    int err = ic->out_len ? 0 : ipc_send(fd, reply, reply_len, &sent);
+    size_t left = reply_len - sent;
+    if (err < 0 || (left && (!ic->out || ic->out_len + left > SUB_BUF))) {
+        stats.ipc_dropped++;
+        done = 1;
+    } else if (left) {
+        memcpy(ic->out + ic->out_len, reply + sent, left);
+        ic->out_len += left;
+    }
+    free(reply);
+    if (done) ipc_close(ic);
+    else ipc_rewatch(ic);
+}
+
+void ipc_ready(int fd, uint32_t events) {
+    IpcClient *ic = ipc_clients;
+    while (ic && ic->fd != fd) ic = ic->next;
+    if (!ic) return;
+
+    if ((events & EPOLLOUT) && ipc_flush(ic) < 0) ipc_close(ic);
+    else if (events & EPOLLIN) ipc_read(ic);
+    else if (events & (EPOLLHUP | EPOLLERR)) ipc_close(ic);
+}
+
+int ipc_connect() {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (!socket_path(addr.sun_path, sizeof(addr.sun_path))) {
+        fprintf(stderr, "madawm: IPC socket path too long\n");
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(addr.sun_path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// madawm msg --bench N [BATCH]: N messages of BATCH layout commands, each
+// sent once the previous one is fully answered
+int ipc_bench(int fd, int n, int batch) {
+    static const char cmd[] = "layout\n";
+    char msg[IPC_BUF], buf[IPC_BUF];
+    size_t len = 0;
+    for (int i = 0; i < batch; i++, len += sizeof(cmd) - 1)
+        memcpy(msg + len, cmd, sizeof(cmd) - 1);
+
+    Histogram latency = {0};
+    uint64_t start = now_us();
+    for (int i = 0; i < n; i++) {
+        uint64_t sent = now_us();
+        if (write(fd, msg, len) != (ssize_t)len) {
+            perror("write");
+            return 1;
+        }
+        for (int replies = 0; replies < batch; ) {
+            ssize_t got = read(fd, buf, sizeof(buf));
+            if (got <= 0) {
+                fprintf(stderr, "madawm: connection closed\n");
+                return 1;
+            }
+            for (ssize_t j = 0; j < got; j++) replies += buf[j] == '\n';
+        }
+        hist_record(&latency, now_us() - sent);
+    }
+    uint64_t total = now_us() - start;
+
+    printf("messages %d commands %d p50_us %llu p99_us %llu commands_per_sec %.0f\n",
+           n, n * batch,
+           (unsigned long long)hist_percentile(&latency, 50),
+           (unsigned long long)hist_percentile(&latency, 99),
+           total ? n * batch / (total / 1e6) : 0.0);
+    return 0;
+}
+
+// madawm msg: send the arguments (or stdin) as one message, print replies
+int ipc_msg(int argc, char *argv[]) {
+    int bench = argc && strcmp(argv[0], "--bench") == 0;
+    int n = bench && argc > 1 ? atoi(argv[1]) : 0;
+    int batch = bench && argc > 2 ? atoi(argv[2]) : 1;
+    if (bench && (n < 1 || batch < 1 || batch > IPC_BUF / 8)) {
+        fprintf(stderr, "usage: madawm msg --bench N [BATCH]\n");
+        return 1;
+    }
+
+    int fd = ipc_connect();
+    if (fd < 0) return 1;
+    if (bench) return ipc_bench(fd, n, batch);
+
+    char *msg;
+    size_t len;
+    FILE *out = open_memstream(&msg, &len);
+    if (!out) die("open_memstream");
+    if (argc) {
+        for (int i = 0; i < argc; i++) fprintf(out, "%s\n", argv[i]);
+    } else {
+        char buf[IPC_BUF];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), stdin)) > 0) fwrite(buf, 1, n, out);
+    }
+    fclose(out);
+    for (size_t off = 0; off < len; ) {
+        ssize_t n = write(fd, msg + off, len - off);
+        if (n < 0) {
+            perror("write");
+            return 1;
+        }
+        off += n;
+    }
+    free(msg);
+    shutdown(fd, SHUT_WR);
+
+    // Subscribers are read line by line by bars through a pipe
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    FILE *in = fdopen(fd, "r");
+    if (!in) die("fdopen");
+    int status = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, in) > 0) {
+        fputs(line, stdout);
+        if (strncmp(line, "error ", 6) == 0) status = 1;
+    }
+    free(line);
+    fclose(in);
+    return status;
+}
+
+// shm_open() name: $MADAWM_SHM, or /madawm-<display>
+void snapshot_open() {
+    const char *env = getenv("MADAWM_SHM");
+    char name[64];
+    display_name(name, sizeof(name));
+    if (env && *env) snprintf(snapshot_name, sizeof(snapshot_name), "%s", env);
+    else snprintf(snapshot_name, sizeof(snapshot_name), "/madawm-%s", name);
+
+    int fd = shm_open(snapshot_name, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror(snapshot_name);
+        return;
+    }
+    if (ftruncate(fd, sizeof(Snapshot)) < 0) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(snapshot_name);
+        return;
+    }
+    void *p = mmap(NULL, sizeof(Snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(snapshot_name);
+        return;
+    }
+    snapshot = p;
+    // A previous instance may have died mid-update and left seq odd
+    atomic_store_explicit(&snapshot->seq, 0, memory_order_relaxed);
+    snapshot->magic = SNAPSHOT_MAGIC;
+    snapshot->version = SNAPSHOT_VERSION;
+    snapshot->size = sizeof(Snapshot);
+}
+
+// Called once per loop iteration; readers never block us and we never
+// wait for them
+void snapshot_update() {
+    if (!snapshot || !snapshot_dirty) return;
+    snapshot_dirty = 0;
+    stats.snapshots++;
+
+    uint32_t seq = atomic_load_explicit(&snapshot->seq, memory_order_relaxed);
+    atomic_store_explicit(&snapshot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    snapshot->updated_us = now_us();
+    snapshot->screen_w = screen_w;
+    snapshot->screen_h = screen_h;
+    snapshot->current_ws = cur_ws;
+    snapshot->workspaces = WORKSPACES;
+    snapshot->focused = focused ? focused->w : 0;
+    uint32_t n = 0, truncated = 0;
+    for (int i = 0; i < WORKSPACES; i++) {
+        uint32_t count = 0;
+        for (Client *c = workspaces[i].head; c; c = c->next) {
+            if (c->placeholder) continue;
+            count++;
+            if (n == SNAPSHOT_CLIENTS) {
+                truncated++;
+                continue;
+            }
+            SnapshotClient *sc = &snapshot->clients[n++];
+            sc->window = c->w;
+            sc->pid = c->pid;
+            sc->x = c->x;
+            sc->y = c->y;
+            sc->width = c->width;
+            sc->height = c->height;
+            sc->workspace = c->workspace;
+            sc->mapped = c->mapped;
+            sc->focused = c == focused;
+            sc->parked = c->parked;
+        }
+        snapshot->ws_clients[i] = count;
+    }
+    snapshot->nclients = n;
+    snapshot->truncated = truncated;
+
+    atomic_store_explicit(&snapshot->seq, seq + 2, memory_order_release);
+}
+
+void setup() {
+    dpy = XOpenDisplay(NULL);
+    if (!dpy) die("Cannot open display");
+
+    // Launched apps must not inherit the X socket
+    if (fcntl(ConnectionNumber(dpy), F_SETFD, FD_CLOEXEC) < 0) die("fcntl");
+
+    xcb = XGetXCBConnection(dpy);
+    root = DefaultRootWindow(dpy);
+    screen_w = DisplayWidth(dpy, DefaultScreen(dpy));
+    screen_h = DisplayHeight(dpy, DefaultScreen(dpy));
+
+    // Check if another WM is running
+    XSetErrorHandler(NULL);
+    XSelectInput(dpy, root, SubstructureRedirectMask | SubstructureNotifyMask);
+    XSync(dpy, False);
+    XSetErrorHandler(xerror);
+
+    // Intern atoms
+    wm_protocols = XInternAtom(dpy, "WM_PROTOCOLS", False);
+    wm_delete_window = XInternAtom(dpy, "WM_DELETE_WINDOW", False);
+    wm_take_focus = XInternAtom(dpy, "WM_TAKE_FOCUS", False);
+
+    char *netnames[NetLast] = {
+        "_NET_SUPPORTED", "_NET_SUPPORTING_WM_CHECK", "_NET_WM_NAME",
+        "_NET_NUMBER_OF_DESKTOPS", "_NET_CURRENT_DESKTOP", "_NET_WM_DESKTOP",
+        "_NET_WM_STATE", "_NET_WM_STATE_HIDDEN", "_NET_WM_STATE_FOCUSED",
+        "_NET_WM_PID", "_NET_STARTUP_ID", "UTF8_STRING"
+    };
+    XInternAtoms(dpy, netnames, NetLast, False, netatom);
+
+    // EWMH clients only trust these hints once a WM check window exists
+    wm_check = XCreateSimpleWindow(dpy, root, 0, 0, 1, 1, 0, 0, 0);
+    XChangeProperty(dpy, wm_check, netatom[NetSupportingWMCheck], XA_WINDOW, 32,
+                    PropModeReplace, (unsigned char *)&wm_check, 1);
+    XChangeProperty(dpy, wm_check, netatom[NetWMName], netatom[NetUTF8String], 8,
+                    PropModeReplace, (unsigned char *)"madaWM", 6);
+    XChangeProperty(dpy, root, netatom[NetSupportingWMCheck], XA_WINDOW, 32,
+                    PropModeReplace, (unsigned char *)&wm_check, 1);
+    XChangeProperty(dpy, root, netatom[NetSupported], XA_ATOM, 32,
+                    PropModeReplace, (unsigned char *)netatom, NetUTF8String);
+
+    long desktops[2] = { WORKSPACES, cur_ws };
+    XChangeProperty(dpy, root, netatom[NetNumberOfDesktops], XA_CARDINAL, 32,
+                    PropModeReplace, (unsigned char *)&desktops[0], 1);
+    XChangeProperty(dpy, root, netatom[NetCurrentDesktop], XA_CARDINAL, 32,
+                    PropModeReplace, (unsigned char *)&desktops[1], 1);
+
+    add_classes(terminal_classes, 0);
+    add_classes(browser_classes, 1);
+    set_parked_classes(parked_classes);
+
+    // One full-screen container per workspace; the root background shows
+    // through, and clients mapping or configuring inside are redirected here
+    XSetWindowAttributes wa = {
+        .background_pixmap = ParentRelative,
+        .override_redirect = True,
+        .event_mask = SubstructureRedirectMask | SubstructureNotifyMask
+    };
+    for (int i = 0; i < WORKSPACES; i++) {
+        workspaces[i].container = XCreateWindow(dpy, root, 0, 0, screen_w, screen_h,
+                                                0, CopyFromParent, InputOutput,
+                                                CopyFromParent,
+                                                CWBackPixmap | CWOverrideRedirect | CWEventMask,
+                                                &wa);
+    }
+    XMapWindow(dpy, workspaces[cur_ws].container);
+
+    grab_keys();
+
+    if (RELAYOUT_DELAY_MS > 0) {
+        layout_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (layout_timer < 0) die("timerfd_create");
+    }
+    // Blocked before the priority thread starts so it inherits the mask;
+    // spawned children get an empty mask back
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGCHLD);
+    sigaddset(&sigs, SIGUSR1);
+    if (sigprocmask(SIG_BLOCK, &sigs, NULL) < 0) die("sigprocmask");
+    signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) die("signalfd");
+
+    placeholder_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (placeholder_timer < 0) die("timerfd_create");
+    if (FREEZE_BACKGROUND) {
+        freeze_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (freeze_timer < 0) die("timerfd_create");
+    }
+    if (gethostname(hostname, sizeof(hostname)) < 0) hostname[0] = '\0';
+    hostname[sizeof(hostname) - 1] = '\0';
+    if ((FREEZE_BACKGROUND || PRIORITY_CGROUP) &&
+        !read_cgroup(getpid(), own_cgroup, sizeof(own_cgroup)))
+        own_cgroup[0] = '\0';
+    // A nice value is only lowered down to 20 - RLIMIT_NICE without
+    // CAP_SYS_NICE; if NICE_FOCUSED is out of reach, renicing would be
+    // one-way and every app would end up deprioritized
+    struct rlimit rl;
+    if (PRIORITY_BOOST) {
+        nice_reversible = geteuid() == 0 ||
+                          (getrlimit(RLIMIT_NICE, &rl) == 0 &&
+                           (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= 20 - NICE_FOCUSED));
+        if (!nice_reversible)
+            fprintf(stderr, "madawm: RLIMIT_NICE too low, not renicing by focus\n");
+    }
+    if (PRIORITY_BOOST && (errno = pthread_create(&prio_thread, NULL, prio_worker, NULL)))
+        die("pthread_create");
+
+    // Set cursor
+    XDefineCursor(dpy, root, XCreateFontCursor(dpy, 68));
+
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) die("epoll_create1");
+    watch_fd(ConnectionNumber(dpy), WatchX);
+    watch_fd(layout_timer, WatchLayout);
+    watch_fd(freeze_timer, WatchFreeze);
+    watch_fd(placeholder_timer, WatchPlaceholder);
+    watch_fd(signal_fd, WatchSignal);
+    ipc_listen();
+    snapshot_open();
+
+    fill_pool();
+}
+
+void cleanup() {
+    dump_stats(stderr);
+
+    // Nobody has seen the warm terminals, close them with us
+    while (pool) {
+        Client *c = pool;
+        pool_unlink(c);
+        close_client(c);
+        free(c);
+    }
+    while (launches) {
+        Launch *l = launches;
+        launches = l->next;
+        free(l);
+    }
+    while (children) {
+        Child *ch = children;
+        children = ch->next;
+        free(ch);
+    }
+    while (launch_stats) {
+        LaunchStats *ls = launch_stats;
+        launch_stats = ls->next;
+        free(ls);
+    }
+
+    // Nothing may stay stopped once we are gone
+    while (procs) {
+        Proc *p = procs;
+        procs = p->next;
+        thaw_proc(p);
+        free(p);
+    }
+
+    for (int i = 0; i < WORKSPACES; i++) {
+        while (workspaces[i].head) {
+            Client *c = workspaces[i].head;
+            detach(c);
+            if (c->placeholder) {
+                free(c);
+                continue;
+            }
+            XUnmapWindow(dpy, c->w);
+            if (!c->park) {
+                XReparentWindow(dpy, c->w, root, c->x, c->y);
+                XRemoveFromSaveSet(dpy, c->w);
+            }
+            free(c);
+        }
+        XDestroyWindow(dpy, workspaces[i].container);
+    }
+    free(client_table);
+    free(pending);
+    for (int i = 0; i < CLASS_TABLE_SIZE; i++)
+        free(class_table[i].name);
+    if (PRIORITY_BOOST) {
+        pthread_mutex_lock(&prio_lock);
+        prio_stop = 1;
+        pthread_cond_signal(&prio_cond);
+        pthread_mutex_unlock(&prio_lock);
+        pthread_join(prio_thread, NULL);
+    }
+    if (layout_timer >= 0) close(layout_timer);
+    if (freeze_timer >= 0) close(freeze_timer);
+    close(placeholder_timer);
+    close(signal_fd);
+    while (ipc_clients) ipc_close(ipc_clients);
+    if (ipc_fd >= 0) {
+        close(ipc_fd);
+        unlink(ipc_path);
+    }
+    close(epoll_fd);
+    if (snapshot) {
+        munmap(snapshot, sizeof(Snapshot));
+        shm_unlink(snapshot_name);
+    }
+    XDestroyWindow(dpy, wm_check);
+    XDeleteProperty(dpy, root, netatom[NetSupported]);
+    XDeleteProperty(dpy, root, netatom[NetSupportingWMCheck]);
+    XCloseDisplay(dpy);
+}
+
+void handle_event(XEvent *ev) {
+    switch (ev->type) {
+        case MapRequest:
+            handle_maprequest(ev);
+            break;
+        case UnmapNotify:
+            handle_unmap(ev);
+            break;
+        case DestroyNotify:
+            handle_destroy(ev);
+            break;
+        case ConfigureRequest:
+            handle_configure_request(ev);
+            break;
+        case EnterNotify:
+            handle_enternotify(ev);
+            break;
+        case FocusIn:
+            handle_focusin(ev);
+            break;
+        case PropertyNotify:
+            handle_propertynotify(ev);
+            break;
+        case KeyPress: {
+            KeySym k = XLookupKeysym(&ev->xkey, 0);
+            unsigned int state = ev->xkey.state & ~(LockMask | Mod2Mask);
+
+            if (state == Mod4Mask) {
+                if (k == XK_Return) {
+                    spawn_terminal();
+                } else if (k == XK_b) {
+                    spawn_tiled("firefox");
+                } else if (k == XK_1) {
+                    change_ws(0);
+                } else if (k == XK_2) {
+                    change_ws(1);
+                } else if (k == XK_h) {
+                    focus_prev();
+                } else if (k == XK_l) {
+                    focus_next();
+                }
+            } else if (state == (Mod4Mask | ShiftMask)) {
+                if (k == XK_c) {
+                    kill_focused();
+                } else if (k == XK_q) {
+                    running = 0;
+                }
+            }
+            break;
+        }
+    }
+}
+
+// Called once the event queue is drained: lay out now, or open the
+// coalescing window so a burst of maps costs a single retile
+void schedule_layout() {
+    if (!workspaces[cur_ws].dirty) return;
+    if (layout_now || layout_timer < 0) {
+        arrange();
+        return;
+    }
+    if (layout_armed) return;
+
+    struct itimerspec its = {
+        .it_value = {
+            .tv_sec = RELAYOUT_DELAY_MS / 1000,
+            .tv_nsec = (RELAYOUT_DELAY_MS % 1000) * 1000000L
+        }
+    };
+    if (timerfd_settime(layout_timer, 0, &its, NULL) < 0) die("timerfd_settime");
+    layout_armed = 1;
+}
+
+void layout_timeout() {
+    uint64_t expirations;
+    if (read(layout_timer, &expirations, sizeof(expirations)) < 0) return;
+    layout_armed = 0;
+    if (workspaces[cur_ws].dirty) arrange();
+}
+
+// Drain queued X events within LOOP_BUDGET_US, then do at most one layout
+// pass and one flush before looking at the other fds again
+void run() {
+    XEvent ev;
+    struct epoll_event ready[WatchLast];
+    unsigned long handled = 0;  // X events since the last wakeup
+
+    while (running) {
+        uint64_t start = now_us();
+        while (running && XPending(dpy)) {
+            XNextEvent(dpy, &ev);
+            HandlerMark mark = handler_begin();
+            handle_event(&ev);
+            handler_end(ev.type >= 0 && ev.type < LASTEvent ? ev.type : HANDLER_OTHER,
+                        mark);
+            handled++;
+            if (now_us() - start > LOOP_BUDGET_US) {
+                stats.budget_overruns++;
+                break;
+            }
+        }
+        if (!running) break;
+
+        if (npending) {
+            HandlerMark mark = handler_begin();
+            manage_pending();
+            handler_end(HANDLER_PENDING, mark);
+        }
+        schedule_layout();
+        XFlush(dpy);
+        ipc_flush_all();
+        snapshot_update();
+
+        // Cut short, or waiting for replies or flushing read events already.
+        // The other fds are still polled so an event storm cannot starve them.
+        int more = XEventsQueued(dpy, QueuedAfterReading);
+        if (!more) {
+            stats.x_events += handled;
+            hist_record(&stats.events_per_wakeup, handled);
+            handled = 0;
+        }
+
+        uint64_t idle = now_us();
+        int n = epoll_wait(epoll_fd, ready, WatchLast, more ? 0 : -1);
+        stats.idle_us += now_us() - idle;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("epoll_wait");
+        }
+        if (!more) stats.wakeups++;
+        for (int i = 0; i < n; i++) {
+            int fd = ready[i].data.u64 >> 32;
+            switch ((uint32_t)ready[i].data.u64) {
+                case WatchLayout: layout_timeout(); break;
+                case WatchFreeze: freeze_timeout(); break;
+                case WatchPlaceholder: placeholder_timeout(); break;
+                case WatchSignal: handle_signals(); break;
+                case WatchIpc: ipc_accept(); break;
+                case WatchIpcClient: {
+                    HandlerMark mark = handler_begin();
+                    ipc_ready(fd, ready[i].events);
+                    handler_end(HANDLER_IPC, mark);
+                    break;
+                }
+                case WatchX: break;  // Read at the top of the loop
+            }
+        }
+    }
+}
+
+#ifdef BENCH
+// Benchmarks instead of the WM: madaWM-bench [table|spawn|map|switch|park]
+// Build: gcc -O2 -DBENCH -o madaWM-bench madawm.c -pthread -lX11 -lX11-xcb -lxcb
+// table and spawn need no X server. The others run as the window manager of $DISPLAY
+// (e.g. xvfb-run -a ./madaWM-bench map) with a second connection
+// playing the applications.
+#define BENCH_LOOKUPS 10000000
+#define BENCH_ROUNDS 20
+#define BENCH_WINDOWS_MAX 100
+#define BENCH_SPAWNS 200
+
+Display *bench_app;
+
+void bench_open() {
+    setup();
+    bench_app = XOpenDisplay(NULL);
+    if (!bench_app) die("Cannot open display");
+}
+
+void bench_close() {
+    XCloseDisplay(bench_app);
+    cleanup();
+}
+
+// WM_CLASS decides where it goes: a terminal lands on WS0, a browser on WS1
+Window bench_window(const char *cls) {
+    Window w = XCreateSimpleWindow(bench_app, DefaultRootWindow(bench_app),
+                                   0, 0, 100, 100, 0, 0, 0);
+    XClassHint hint = { (char *)cls, (char *)cls };
+    XSetClassHint(bench_app, w, &hint);
+    XSelectInput(bench_app, w, StructureNotifyMask);
+    return w;
+}
+
+// One pass of run() that does not block
+void bench_pump() {
+    XEvent ev;
+    while (XPending(dpy)) {
+        XNextEvent(dpy, &ev);
+        handle_event(&ev);
+    }
+    manage_pending();
+    schedule_layout();
+    XFlush(dpy);
+}
+
+// Run the WM until the applications have seen n of their windows mapped
+void bench_wait_mapped(int n) {
+    XEvent ev;
+    while (n > 0) {
+        bench_pump();
+        while (n > 0 && XPending(bench_app)) {
+            XNextEvent(bench_app, &ev);
+            if (ev.type == MapNotify) n--;
+        }
+    }
+}
+
+void bench_destroy(Window *wins, int n) {
+    for (int i = 0; i < n; i++) XDestroyWindow(bench_app, wins[i]);
+    XSync(bench_app, False);
+    while (client_table_len) bench_pump();
+    XSync(bench_app, True);
+}
+
+void bench_report(const char *what, int n, const Histogram *h) {
+    printf("%s %3d p50_us %llu p99_us %llu", what, n,
+           (unsigned long long)hist_percentile(h, 50),
+           (unsigned long long)hist_percentile(h, 99));
+}
+
+// Map-to-visible latency of n windows mapped at once, and how many times
+// the WM waited for X replies to manage them
+void bench_map() {
+    static const int sizes[] = { 1, 10, 100 };
+    Window wins[BENCH_WINDOWS_MAX];
+
+    bench_open();
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        Histogram h = {0};
+        unsigned long round_trips = 0;
+        for (int r = 0; r < BENCH_ROUNDS; r++) {
+            for (int i = 0; i < n; i++) wins[i] = bench_window("xterm");
+            XSync(bench_app, False);
+
+            unsigned long waits = stats.round_trips;
+            uint64_t start = now_us();
+            for (int i = 0; i < n; i++) XMapWindow(bench_app, wins[i]);
+            XFlush(bench_app);
+            bench_wait_mapped(n);
+            hist_record(&h, now_us() - start);
+            round_trips += stats.round_trips - waits;
+
+            bench_destroy(wins, n);
+        }
+        bench_report("maps", n, &h);
+        printf(" round_trips %.1f\n", (double)round_trips / BENCH_ROUNDS);
+    }
+    bench_close();
+}
+
+// One workspace switch, until the server has carried out all of it
+uint64_t bench_switch_to(int ws) {
+    uint64_t start = now_us();
+    change_ws(ws);
+    schedule_layout();
+    XSync(dpy, False);
+    uint64_t us = now_us() - start;
+    bench_pump();  // Focus and crossing events the switch caused
+    return us;
+}
+
+// Switch latency with n windows of cls on their workspace, away from it
+// and back to it
+void bench_switch_windows(const char *what, const char *cls) {
+    static const int sizes[] = { 1, 10, 100 };
+    Window wins[BENCH_WINDOWS_MAX];
+    int ws = lookup_class(cls)->workspace;
+    char away_name[32], back_name[32];
+    snprintf(away_name, sizeof(away_name), "%s_away", what);
+    snprintf(back_name, sizeof(back_name), "%s_back", what);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        for (int i = 0; i < n; i++) {
+            wins[i] = bench_window(cls);
+            XMapWindow(bench_app, wins[i]);
+        }
+        XFlush(bench_app);
+        bench_wait_mapped(n);
+
+        Histogram away = {0}, back = {0};
+        for (int r = 0; r < BENCH_ROUNDS; r++) {
+            hist_record(&away, bench_switch_to((ws + 1) % WORKSPACES));
+            hist_record(&back, bench_switch_to(ws));
+        }
+        bench_report(away_name, n, &away);
+        printf("\n");
+        bench_report(back_name, n, &back);
+        printf("\n");
+        bench_destroy(wins, n);
+    }
+}
+
+// Terminals on WS0, hidden with their container
+void bench_switch() {
+    bench_open();
+    bench_switch_windows("switch", "xterm");
+    bench_close();
+}
+
+// Browsers on WS1, hidden by unmapping and then by parking off-screen
+void bench_park() {
+    bench_open();
+    ClassEntry *ce = lookup_class("firefox");
+    int park = ce->park;
+    ce->park = 0;
+    bench_switch_windows("unmap", "firefox");
+    ce->park = 1;
+    bench_switch_windows("park", "firefox");
+    ce->park = park;
+    bench_close();
+}
+
+// WM-side cost of a launch as the WM's heap grows; posix_spawn() does
+// not copy page tables, so it should not care how much memory we touched
+void bench_spawn() {
+    static const size_t heap_mb[] = { 0, 256, 1024 };
+
+    for (size_t s = 0; s < sizeof(heap_mb) / sizeof(heap_mb[0]); s++) {
+        size_t size = heap_mb[s] << 20;
+        char *heap = NULL;
+        if (size && !(heap = malloc(size))) die("malloc");
+        for (size_t i = 0; i < size; i += 4096)
+            ((volatile char *)heap)[i] = 1;
+
+        Histogram spawn = {0}, reaped = {0};
+        for (int i = 0; i < BENCH_SPAWNS; i++) {
+            uint64_t start = now_us();
+            Launch *l = spawn_cmd("true", 0);
+            if (!l) exit(1);
+            uint64_t spawned = now_us();
+
+            pid_t pid = l->pid;
+            int status;
+            struct rusage ru;
+            if (wait4(pid, &status, 0, &ru) < 0) die("wait4");
+            child_exited(pid, status, &ru);
+            abandon_launch(pid);
+            hist_record(&spawn, spawned - start);
+            hist_record(&reaped, now_us() - start);
+        }
+        printf("heap_mb %4zu spawn p50_us %llu p99_us %llu with_reap p50_us %llu p99_us %llu\n",
+               heap_mb[s],
+               (unsigned long long)hist_percentile(&spawn, 50),
+               (unsigned long long)hist_percentile(&spawn, 99),
+               (unsigned long long)hist_percentile(&reaped, 50),
+               (unsigned long long)hist_percentile(&reaped, 99));
+        free(heap);
+    }
+}
+
+// Client table lookup cost at growing client counts
+void bench_table() {
+    static const int sizes[] = { 10, 100, 1000, 10000 };
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+        Client *clients = calloc(n, sizeof(Client));
+        if (!clients) die("calloc");
+
+        // XIDs as the server hands them out: a resource base per X client,
+        // windows numbered upwards within it
+        for (int i = 0; i < n; i++) {
+            clients[i].w = (Window)(i % 16 + 1) << 21 | (i / 16 * 4 + 1);
+            if ((client_table_len + 1) * 2 > client_table_cap) client_table_grow();
+            client_table_insert(&clients[i]);
+        }
+
+        unsigned long found = 0;
+        uint32_t r = 1;
+        uint64_t start = now_ns();
+        for (int i = 0; i < BENCH_LOOKUPS; i++) {
+            r = r * 1664525u + 1013904223u;
+            found += find_client(clients[r % n].w) != NULL;
+        }
+        uint64_t ns = now_ns() - start;
+
+        printf("clients %5d lookup_ns %.1f found %lu\n", n,
+               (double)ns / BENCH_LOOKUPS, found);
+        free(client_table);
+        client_table = NULL;
+        client_table_cap = client_table_len = 0;
+        free(clients);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *mode = argc > 1 ? argv[1] : "table";
+    if (strcmp(mode, "table") == 0) {
+        bench_table();
+    } else if (strcmp(mode, "spawn") == 0) {
+        bench_spawn();
+    } else if (strcmp(mode, "map") == 0) {
+        bench_map();
+    } else if (strcmp(mode, "switch") == 0) {
+        bench_switch();
+    } else if (strcmp(mode, "park") == 0) {
+        bench_park();
+    } else {
+        fprintf(stderr, "usage: %s [table|spawn|map|switch|park]\n", argv[0]);
+        return 1;
+    }
+    return 0;
 }
+#else
+int main(int argc, char *argv[]) {
+    if (argc > 1 && strcmp(argv[1], "msg") == 0)
+        return ipc_msg(argc - 2, argv + 2);
 
-int main() {
-    signal(SIGCHLD, SIG_IGN);
     setup();
     run();
     cleanup();
     return 0;
 }
+#endif